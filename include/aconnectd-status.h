@@ -0,0 +1,92 @@
+#ifndef _ACONNECTD_STATUS_H
+#define _ACONNECTD_STATUS_H
+
+// Layout of the status page aconnectd publishes in /run/aconnectd/status,
+// for readers that map it instead of talking to the daemon.  Plain C so
+// that it can be used outside the daemon.
+//
+// The page is guarded by a sequence lock: the daemon makes seq odd while
+// it writes and even again when done.  A reader copies what it needs
+// between acd_status_read_begin() and acd_status_read_retry(), and starts
+// over if the latter returns true.  The file only ever grows; a reader
+// whose mapping is shorter than size remaps it and starts over.
+
+#include <stdint.h>
+
+#define ACD_STATUS_MAGIC        0x53444341u     // "ACDS"
+#define ACD_STATUS_VERSION      1
+#define ACD_STATUS_NAME_MAX     64
+
+enum acd_status_state {
+    // An endpoint is absent, or the subscription is yet to be made.
+    ACD_STATUS_PENDING = 0,
+    ACD_STATUS_ACTIVE = 1,
+    // Only retried when the topology changes.
+    ACD_STATUS_FAILED = 2,
+    // Failed, retried after a delay.
+    ACD_STATUS_BACKOFF = 3,
+    ACD_STATUS_DISABLED = 4
+};
+
+struct acd_status_patch {
+    char src_client[ACD_STATUS_NAME_MAX];
+    char src_port[ACD_STATUS_NAME_MAX];
+    char dst_client[ACD_STATUS_NAME_MAX];
+    char dst_port[ACD_STATUS_NAME_MAX];
+    uint32_t state;
+    uint32_t failures;
+    // errno of the last failure.
+    int32_t error;
+    uint32_t reserved;
+};
+
+struct acd_status_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;
+    int32_t pid;
+    // Bytes in use, header included.
+    uint64_t size;
+    // Incremented on every update.
+    uint64_t generation;
+    // CLOCK_MONOTONIC and CLOCK_REALTIME of the last reconcile (ms).
+    uint64_t reconcile_monotonic_ms;
+    uint64_t reconcile_realtime_ms;
+
+    uint64_t reconciles;
+    uint64_t subscriptions_added;
+    uint64_t subscriptions_removed;
+    uint64_t subscriptions_failed;
+
+    uint32_t clients;
+    uint32_t ports;
+    uint32_t subscriptions;
+    uint32_t patch_count;
+    // Patches by enum acd_status_state.
+    uint32_t patch_states[5];
+    uint32_t reserved;
+};
+
+static inline const struct acd_status_patch *acd_status_patches(
+    const struct acd_status_header *header)
+{
+    return (const struct acd_status_patch *)(header + 1);
+}
+
+// Returns the sequence to pass to acd_status_read_retry(); odd while an
+// update is in progress, in which case the reader should retry later.
+static inline uint32_t acd_status_read_begin(const struct acd_status_header *header)
+{
+    return __atomic_load_n(&header->seq, __ATOMIC_ACQUIRE);
+}
+
+static inline int acd_status_read_retry(const struct acd_status_header *header,
+    uint32_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (seq & 1) || __atomic_load_n(&header->seq, __ATOMIC_RELAXED) != seq;
+}
+
+#endif // _ACONNECTD_STATUS_H
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -18,6 +18,37 @@
 //     3 'Nano - SLMk2 MIDI1'
 //     4 'Nano - SLMk2 MIDI2'
 
+typedef unsigned acdNameId;
+typedef pair<acdNameId, acdNameId> acdEndpointKey;
+typedef pair<acdEndpointKey, acdEndpointKey> acdPatchKey;
+
+struct acdEndpointKeyHash
+{
+    inline size_t operator()(const acdEndpointKey &key) const {
+        return (size_t)key.first * 0x9e3779b1u ^ (size_t)key.second;
+    }
+};
+
+class acdNameTable
+{
+public:
+    static const acdNameId invalid = (acdNameId)-1;
+
+    // ALSA pads some names with trailing spaces (see 'Timer' above), they
+    // are stripped so that configured and enumerated names intern alike.
+    static void Normalize(const string &name, string &normalized);
+
+    acdNameId Intern(const string &name);
+    acdNameId Find(const string &name) const;
+
+    inline const string &Name(acdNameId id) const { return names[id]; }
+    inline size_t Size(void) const { return names.size(); }
+
+protected:
+    unordered_map<string, acdNameId> ids;
+    vector<string> names;
+};
+
 class acdPatch
 {
 public:
@@ -25,79 +56,931 @@ public:
     const string src_port;
     const string dst_client;
     const string dst_port;
+    const acdPatchKey key;
     int queue;
     int convert_real;
     int convert_time;
     bool exclusive;
 
-    acdPatch(
+    acdPatch(acdNameTable &names,
         const string &src_client, const string &src_port,
         const string &dst_client, const string &dst_port,
         int queue, int convert_real, int convert_time,
         bool exclusive) :
         src_client(src_client), src_port(src_port),
         dst_client(dst_client), dst_port(dst_port),
+        key(
+            acdEndpointKey(names.Intern(src_client), names.Intern(src_port)),
+            acdEndpointKey(names.Intern(dst_client), names.Intern(dst_port))
+        ),
         queue(queue), convert_real(convert_real), convert_time(convert_time),
         exclusive(exclusive) { }
 
-    inline void MakeKey(pair<string, string> &key) const {
-        key.first = src_client + "/" + src_port;
-        key.second = dst_client + "/" + dst_port;
+    inline const acdPatchKey &MakeKey(void) const { return key; }
+
+    inline bool SameOptions(const acdPatch &other) const {
+        return (queue == other.queue && convert_real == other.convert_real &&
+            convert_time == other.convert_time && exclusive == other.exclusive);
     }
 };
 
+// One endpoint name of a rule: exact, a glob (a name with '*', '?' or
+// '[') or a POSIX extended regular expression (a name starting with '~').
+class acdRegex;
+class acdMatcher
+{
+public:
+    enum Type {
+        mtEXACT,
+        mtGLOB,
+        mtREGEX
+    };
+
+    enum Type type;
+    string pattern;
+    // Literal text every matching name starts or ends with.
+    string prefix;
+    string suffix;
+
+    acdMatcher() : type(mtEXACT) { }
+
+    static bool IsPattern(const string &name);
+
+    // Throws invalid_argument if the regular expression doesn't compile.
+    void Compile(const string &name, bool literal = false);
+    bool Match(const string &name) const;
+
+protected:
+    shared_ptr<acdRegex> regex;
+};
+
+// One test of a port and its client, (attribute & mask) == value, taken
+// from the attributes of a rule.
+class acdPort;
+class acdPredicate
+{
+public:
+    enum Field {
+        pfCLIENT_TYPE,
+        pfCARD,
+        pfPID,
+        pfCAPABILITY,
+        pfTYPE
+    };
+
+    enum Field field;
+    unsigned mask;
+    unsigned value;
+
+    acdPredicate(enum Field field, unsigned mask, unsigned value) :
+        field(field), mask(mask), value(value) { }
+
+    bool Test(const acdPort &port) const;
+};
+
+// Options of the patches rules and matrices add.
+class acdPatchOptions
+{
+public:
+    int queue;
+    int convert_real;
+    int convert_time;
+    bool exclusive;
+
+    acdPatchOptions() : queue(0), convert_real(0), convert_time(0),
+        exclusive(false) { }
+};
+
+// A patch with patterns or attributes, expanded into a patch for every
+// pair of present endpoints it matches.
+class acdRule : public acdPatchOptions
+{
+public:
+    acdMatcher src_client;
+    acdMatcher src_port;
+    acdMatcher dst_client;
+    acdMatcher dst_port;
+    // All must hold for a port to match the side.
+    vector<acdPredicate> src_attributes;
+    vector<acdPredicate> dst_attributes;
+
+    // Present endpoints matching either side.
+    set<acdEndpointKey> src;
+    set<acdEndpointKey> dst;
+};
+
+// Rules indexed by the longest literal prefix or suffix of each side, so
+// that a new endpoint is only matched against the rules it may satisfy.
+class acdRuleIndex
+{
+public:
+    typedef pair<acdPatchKey, const acdPatchOptions *> Match;
+
+    void Add(const acdRule &rule);
+    void Clear(void);
+    void Swap(acdRuleIndex &other);
+
+    inline bool Empty(void) const { return rules.empty(); }
+    inline size_t Size(void) const { return rules.size(); }
+
+    // The pairs that start (or stop) matching when an endpoint appears (or
+    // goes away).  A pair matched by several rules is reported once per
+    // rule; rule pointers are valid until the next Add().
+    void Appear(const acdPort &port,
+        const acdNameTable &names, vector<Match> &added);
+    // A present port's attributes changed: it's tested again against the
+    // rules its names match.
+    void Change(const acdPort &port, const acdNameTable &names,
+        vector<Match> &added, vector<acdPatchKey> &removed);
+    void Gone(const acdEndpointKey &key,
+        const acdNameTable &names, vector<acdPatchKey> &removed);
+    // Forgets the endpoints that aren't present.
+    void Retain(function<bool(const acdEndpointKey &key)> present,
+        vector<acdPatchKey> &removed);
+
+protected:
+    enum Side {
+        sdSRC,
+        sdDST
+    };
+
+    class Entry
+    {
+    public:
+        unsigned rule;
+        enum Side side;
+
+        Entry(unsigned rule, enum Side side) : rule(rule), side(side) { }
+    };
+
+    void Candidates(const string &client, const string &port,
+        vector<Entry> &entries) const;
+    void Update(const acdPort &port, const acdNameTable &names,
+        vector<Match> &added, vector<acdPatchKey> *removed);
+    void Index(unsigned rule, enum Side side,
+        const acdMatcher &client, const acdMatcher &port);
+
+    vector<acdRule> rules;
+    // Entries without a literal affix, tried for every endpoint.
+    vector<Entry> unindexed;
+    // By client or port name, then prefix or suffix.
+    unordered_map<string, vector<Entry>> affixes[2][2];
+    set<size_t> lengths[2][2];
+};
+
+// A name with "{variable}" placeholders, see acdMatrix.
+class acdTemplate
+{
+public:
+    // Numbers the variables used in variables; throws invalid_argument on
+    // an unterminated or empty placeholder.
+    void Compile(const string &text, map<string, unsigned> &variables);
+
+    void Expand(const vector<string> &values, string &name) const;
+    // Calls found for every binding of the unbound variables (marked in
+    // bound) that expands to name; values and bound are restored after.
+    void Match(const string &name, vector<string> &values,
+        vector<bool> &bound, function<void()> found) const;
+
+protected:
+    class Segment
+    {
+    public:
+        string literal;
+        // Or -1 for a literal.
+        int variable;
+
+        Segment(const string &literal, int variable) :
+            literal(literal), variable(variable) { }
+    };
+
+    void Match(const string &name, size_t pos, size_t segment,
+        vector<string> &values, vector<bool> &bound,
+        function<void()> &found) const;
+
+    vector<Segment> segments;
+};
+
+// Patches from every source to every destination, their names made from
+// the variables of each row by templates.  Patches are only made for the
+// pairs whose endpoints are present: an endpoint that appears is matched
+// against the templates, which binds the variables to look its rows up by.
+class acdMatrix : public acdPatchOptions
+{
+public:
+    enum Side {
+        sdSRC,
+        sdDST
+    };
+
+    acdTemplate src_client;
+    acdTemplate src_port;
+    acdTemplate dst_client;
+    acdTemplate dst_port;
+    // Numbered by the templates.
+    map<string, unsigned> variables;
+    // The side defining each variable.
+    vector<enum Side> sides;
+    // Values by variable number; those of the other side are empty.
+    vector<vector<string>> rows[2];
+
+    // Indexes the rows; throws invalid_argument if a variable isn't
+    // defined by every row of exactly one side.
+    void Index(void);
+
+    void Appear(const acdEndpointKey &key, const acdNameTable &names,
+        function<bool(const acdEndpointKey &key)> present,
+        vector<acdRuleIndex::Match> &added);
+    void Gone(const acdEndpointKey &key, vector<acdPatchKey> &removed);
+    void Retain(function<bool(const acdEndpointKey &key)> present,
+        vector<acdPatchKey> &removed);
+
+protected:
+    void Rows(enum Side side, const vector<string> &values,
+        const vector<bool> &bound, vector<unsigned> &found) const;
+    void Pair(unsigned src, unsigned dst, const acdNameTable &names,
+        function<bool(const acdEndpointKey &key)> &present,
+        vector<acdRuleIndex::Match> &added);
+
+    // Rows by variable number and value.
+    vector<unordered_map<string, vector<unsigned>>> by_value;
+    // Patches made, by each of their endpoints.
+    unordered_map<acdEndpointKey, set<acdPatchKey>, acdEndpointKeyHash> active;
+};
+
 class acdConfig
 {
 public:
+    // Which observed subscriptions may be removed: all of them, only
+    // those aconnectd created (see acdLedger), or those of the clients in
+    // scope (and owned ones).
+    enum Policy {
+        poTAKEOVER,
+        poOWNED,
+        poSCOPED
+    };
+
     int my_id;
     bool verbose;
+    bool dry_run;
+    bool targeted_verify;
+    // Keep subscriptions on exit, see acdContext::SnapshotSave().
+    bool handoff;
     unsigned refresh_ttl;
-    map<pair<string, string>, acdPatch> patches;
+    enum Policy policy;
+    // Client names managed by the scoped policy.
+    unordered_set<acdNameId> scope;
+    map<acdPatchKey, acdPatch> patches;
+    // Patches with "enabled": false, kept for the control socket.
+    map<acdPatchKey, acdPatch> disabled;
+    // Source endpoints referenced by patches (with a reference count),
+    // see IsVerified().
+    unordered_map<acdEndpointKey, unsigned, acdEndpointKeyHash> sources;
+    // Patches by each of their endpoints, see acdContext::Touch().
+    unordered_map<acdEndpointKey, set<acdPatchKey>, acdEndpointKeyHash> dependents;
+    // Patches with patterns, matrices, and the patches they added with the
+    // number of rules (or matrices) matching each.  Explicit patches take
+    // precedence.
+    acdRuleIndex rules;
+    vector<acdMatrix> matrices;
+    map<acdPatchKey, unsigned> expanded;
+
+    acdConfig() : my_id(-1), verbose(false), dry_run(false),
+        targeted_verify(false), handoff(false), refresh_ttl(0),
+        policy(poTAKEOVER) { }
+
+    // Returns false, leaving the configuration untouched, if the file
+    // can't be read or any patch is invalid.
+    bool Load(const string &filename, acdNameTable &names);
+
+    // In targeted mode, only the subscribers of ports used as a patch
+    // source are queried and managed; the scoped policy adds the ports
+    // of the clients in scope.
+    inline bool IsVerified(const acdEndpointKey &key) const {
+        if (! targeted_verify && policy != poSCOPED) return true;
+        if (sources.find(key) != sources.end()) return true;
+        return (policy == poSCOPED && scope.find(key.first) != scope.end());
+    }
+
+    inline bool HasRules(void) const {
+        return (! rules.Empty() || ! matrices.empty());
+    }
 
-    acdConfig() : my_id(-1), verbose(false), refresh_ttl(30) { }
+    inline void DependentAdd(const acdPatchKey &key) {
+        dependents[key.first].insert(key);
+        dependents[key.second].insert(key);
+    }
+
+    inline void DependentRemove(const acdPatchKey &key) {
+        for (auto &endpoint : { key.first, key.second }) {
+            auto it = dependents.find(endpoint);
+            if (it == dependents.end()) continue;
 
-    void Load(const string &filename);
+            it->second.erase(key);
+            if (it->second.empty()) dependents.erase(it);
+        }
+    }
 };
 
+#ifdef INCLUDE_NLOHMANN_JSON_HPP_
+// Parses one element of "patches"; throws if an endpoint name is missing.
+acdPatch acd_patch_parse(const json &it, acdNameTable &names, bool &enabled);
+// Parses it as a rule if it has attributes or any endpoint name is a
+// pattern (and "match" isn't "exact"); throws if a name is missing or an
+// attribute or regular expression is invalid.
+bool acd_rule_parse(const json &it, acdRule &rule, bool &enabled);
+// Parses one element of "matrices"; throws if it's invalid.
+void acd_matrix_parse(const json &it, acdMatrix &matrix, bool &enabled);
+#endif
+
 typedef pair<int, int> acdSubAddr;
-typedef vector<pair<acdSubAddr, pair<acdSubAddr, int>>> acdSubAddrMap;
+
+class acdSeqClientInfo
+{
+public:
+    int client;
+    string name;
+    int type;
+    int card;
+    int pid;
+
+    acdSeqClientInfo() : client(-1), type(0), card(-1), pid(-1) { }
+};
+
+class acdSeqPortInfo
+{
+public:
+    int client;
+    int port;
+    string name;
+    unsigned capability;
+    unsigned type;
+
+    acdSeqPortInfo() : client(-1), port(-1), capability(0), type(0) { }
+};
+
+class acdSeqEvent
+{
+public:
+    int type;
+    // CLIENT_* and PORT_* events.
+    snd_seq_addr_t addr;
+    // PORT_SUBSCRIBED and PORT_UNSUBSCRIBED events.
+    snd_seq_addr_t sender;
+    snd_seq_addr_t dest;
+};
+
+// Sequencer backend.  Methods mirror the alsa-lib calls they replace and
+// return 0 (or a positive count) on success, or a negative error code.
+class acdSequencer
+{
+public:
+    virtual ~acdSequencer() { }
+
+    virtual int ClientId(void) = 0;
+
+    // Iterate clients; start with info.client = -1.
+    virtual int QueryNextClient(acdSeqClientInfo &info) = 0;
+    virtual int GetClientInfo(int client, acdSeqClientInfo &info) = 0;
+
+    // Iterate ports of info.client; start with info.port = -1.
+    virtual int QueryNextPort(acdSeqPortInfo &info) = 0;
+    virtual int GetPortInfo(int client, int port, acdSeqPortInfo &info) = 0;
+
+    virtual int QuerySubscribers(const snd_seq_addr_t &root,
+        snd_seq_query_subs_type_t type, int index, snd_seq_addr_t &addr) = 0;
+
+    virtual int Subscribe(const snd_seq_addr_t &src, const snd_seq_addr_t &dst,
+        int queue, bool exclusive, int convert_time, int convert_real) = 0;
+    virtual int Unsubscribe(
+        const snd_seq_addr_t &src, const snd_seq_addr_t &dst) = 0;
+
+    // Subscribe to System:Announce; events are then read with EventInput()
+    // when one of the poll descriptors is readable.  EventInput() returns
+    // -EAGAIN once drained, or -ENOSPC if events were lost.
+    virtual int SubscribeAnnounce(void) = 0;
+    virtual int EventInput(acdSeqEvent &event) = 0;
+    virtual int PollDescriptors(vector<struct pollfd> &pfds) = 0;
+};
+
+class acdSequencerALSA : public acdSequencer
+{
+public:
+    acdSequencerALSA() : seq(NULL), owned(false) { }
+    virtual ~acdSequencerALSA();
+
+    int Open(const char *client_name);
+
+    // Uses a sequencer handle owned by the host process.
+    void Attach(snd_seq_t *handle);
+
+    static void Convert(const snd_seq_event_t *ev, acdSeqEvent &event);
+
+    virtual int ClientId(void);
+
+    virtual int QueryNextClient(acdSeqClientInfo &info);
+    virtual int GetClientInfo(int client, acdSeqClientInfo &info);
+
+    virtual int QueryNextPort(acdSeqPortInfo &info);
+    virtual int GetPortInfo(int client, int port, acdSeqPortInfo &info);
+
+    virtual int QuerySubscribers(const snd_seq_addr_t &root,
+        snd_seq_query_subs_type_t type, int index, snd_seq_addr_t &addr);
+
+    virtual int Subscribe(const snd_seq_addr_t &src, const snd_seq_addr_t &dst,
+        int queue, bool exclusive, int convert_time, int convert_real);
+    virtual int Unsubscribe(const snd_seq_addr_t &src, const snd_seq_addr_t &dst);
+
+    virtual int SubscribeAnnounce(void);
+    virtual int EventInput(acdSeqEvent &event);
+    virtual int PollDescriptors(vector<struct pollfd> &pfds);
+
+protected:
+    snd_seq_t *seq;
+    bool owned;
+};
+
+// In-memory sequencer for tests and benchmarks.  Models clients, ports,
+// capabilities, subscriptions with exclusive locks, and System:Announce
+// events (signalled through an eventfd poll descriptor).  Like ALSA,
+// addresses are limited to 8-bit client and port numbers.
+class acdSequencerMock : public acdSequencer
+{
+public:
+    acdSequencerMock(size_t event_limit = 0);
+    virtual ~acdSequencerMock();
+
+    int CreateClient(const string &name,
+        int type = SND_SEQ_USER_CLIENT, int card = -1, int pid = -1);
+    int DeleteClient(int client);
+    int CreatePort(int client, const string &name,
+        unsigned capability, unsigned type = SND_SEQ_PORT_TYPE_MIDI_GENERIC);
+    int DeletePort(int client, int port);
+
+    virtual int ClientId(void) { return my_id; }
+
+    virtual int QueryNextClient(acdSeqClientInfo &info);
+    virtual int GetClientInfo(int client, acdSeqClientInfo &info);
+
+    virtual int QueryNextPort(acdSeqPortInfo &info);
+    virtual int GetPortInfo(int client, int port, acdSeqPortInfo &info);
+
+    virtual int QuerySubscribers(const snd_seq_addr_t &root,
+        snd_seq_query_subs_type_t type, int index, snd_seq_addr_t &addr);
+
+    virtual int Subscribe(const snd_seq_addr_t &src, const snd_seq_addr_t &dst,
+        int queue, bool exclusive, int convert_time, int convert_real);
+    virtual int Unsubscribe(const snd_seq_addr_t &src, const snd_seq_addr_t &dst);
+
+    virtual int SubscribeAnnounce(void);
+    virtual int EventInput(acdSeqEvent &event);
+    virtual int PollDescriptors(vector<struct pollfd> &pfds);
+
+protected:
+    class Port
+    {
+    public:
+        acdSeqPortInfo info;
+        vector<snd_seq_addr_t> subscribers;
+        vector<snd_seq_addr_t> senders;
+        bool exclusive_read;
+        bool exclusive_write;
+
+        Port() : exclusive_read(false), exclusive_write(false) { }
+    };
+
+    class Client
+    {
+    public:
+        acdSeqClientInfo info;
+        map<int, Port> ports;
+    };
+
+    Port *FindPort(const snd_seq_addr_t &addr);
+    void Announce(int type, int client, int port);
+    void Announce(int type, const snd_seq_addr_t &src, const snd_seq_addr_t &dst);
+    void Disconnect(Port &port);
+
+    int my_id;
+    int fd_event;
+    bool announce;
+    bool overrun;
+    size_t event_limit;
+    map<int, Client> clients;
+    deque<acdSeqEvent> events;
+};
+
+// Tells clients with the same name apart.  The first one present is known
+// by its name, the others by "name#2", "name#3"... in the order they
+// appear (by client id within a refresh), and each keeps its number while
+// present so that patches don't move between them.
+class acdInstances
+{
+public:
+    // Returns the name id of the client's instance.
+    acdNameId Assign(acdNameTable &names, int client_id, acdNameId name_id);
+    void Release(int client_id);
+    // Releases the clients that are gone or renamed.
+    void Retain(acdNameTable &names, const vector<acdSeqClientInfo> &infos);
+
+    inline void Clear(void) { clients.clear(); numbers.clear(); }
+
+protected:
+    class Instance
+    {
+    public:
+        acdNameId name_id;
+        unsigned number;
+        acdNameId instance_id;
+    };
+
+    unordered_map<int, Instance> clients;
+    // Numbers taken, by client name.
+    unordered_map<acdNameId, set<unsigned>> numbers;
+};
 
 class acdPort;
+class acdContext;
 class acdClient
 {
 public:
     int id;
     string name;
+    // Of the instance name, see acdInstances.
+    acdNameId name_id;
+    int type;
+    int card;
+    int pid;
 
-    acdClient(snd_seq_client_info_t *cinfo) :
-        id(snd_seq_client_info_get_client(cinfo)),
-        name(snd_seq_client_info_get_name(cinfo)) { }
+    acdClient(acdNameTable &names, const acdSeqClientInfo &info) :
+        id(info.client),
+        name(info.name),
+        name_id(names.Intern(name)),
+        type(info.type),
+        card(info.card),
+        pid(info.pid) { }
 
-    size_t AddPorts(const acdClient &client,
-        snd_seq_t *seq, snd_seq_client_info_t *cinfo);
+    size_t RefreshPorts(acdContext &ctx);
+    bool RefreshPort(acdContext &ctx, int port_id);
 
     map<int, acdPort> ports;
 };
 
 class acdSubscription;
+class acdPlanOp;
 class acdPort
 {
 public:
     const acdClient &client;
     int id;
+    snd_seq_addr_t addr;
     string name;
+    acdNameId name_id;
+    unsigned capability;
+    unsigned type;
 
-    acdPort(const acdClient &client, snd_seq_port_info_t *pinfo) :
+    acdPort(acdNameTable &names,
+        const acdClient &client, const acdSeqPortInfo &info) :
         client(client),
-        id(snd_seq_port_info_get_port(pinfo)),
-        name(snd_seq_port_info_get_name(pinfo)) { }
+        id(info.port),
+        name(info.name),
+        name_id(names.Intern(name)),
+        capability(info.capability),
+        type(info.type) {
+        addr.client = (unsigned char)info.client;
+        addr.port = (unsigned char)info.port;
+    }
+
+    size_t RefreshSubscriptions(acdContext &ctx);
+    size_t AddSubscriptions(acdContext &ctx, snd_seq_query_subs_type_t type);
+
+    set<acdSubAddr> subscribers;
+};
+
+class acdAddressIndex
+{
+public:
+    void Insert(const acdClient &client);
+    void Insert(const acdClient &client, const acdPort &port);
+    void Erase(const acdClient &client);
+    void Erase(const acdClient &client, const acdPort &port);
+
+    inline void Clear(void) { index.clear(); }
+    inline size_t Size(void) const { return index.size(); }
+
+    // Where several ports share a name, the lowest address wins.
+    bool Lookup(const acdEndpointKey &key, snd_seq_addr_t &addr) const;
+
+protected:
+    unordered_map<acdEndpointKey, set<acdSubAddr>, acdEndpointKeyHash> index;
+};
+
+typedef map<acdPatchKey, acdSubscription> acdSubMap;
 
-    size_t AddSubscriptions(snd_seq_t *seq, snd_seq_port_info_t *pinfo);
-    size_t AddSubscriptions(snd_seq_t *seq,
-        snd_seq_query_subscribe_t *subs, snd_seq_query_subs_type_t type);
+class acdPlanOp
+{
+public:
+    enum OpType {
+        opSUBSCRIBE,
+        opUNSUBSCRIBE
+    };
+
+    enum OpType type;
+    acdPatchKey key;
+    snd_seq_addr_t src;
+    snd_seq_addr_t dst;
+    // Subscription options, only set for opSUBSCRIBE.  Valid until the
+    // configuration is reloaded.
+    const acdPatch *patch;
+
+    acdPlanOp(enum OpType type, const acdPatchKey &key,
+        const snd_seq_addr_t &src, const snd_seq_addr_t &dst,
+        const acdPatch *patch = NULL) :
+        type(type), key(key), src(src), dst(dst), patch(patch) { }
+};
+
+typedef vector<acdPlanOp> acdPlan;
+
+class acdBackoff
+{
+public:
+    class Entry
+    {
+    public:
+        unsigned failures;
+        int error;
+        uint64_t retry_at;
+
+        Entry() : failures(0), error(0), retry_at(0) { }
+    };
+
+    // Patches that can never succeed with the current topology.
+    static const uint64_t never = (uint64_t)-1;
+
+    acdBackoff(unsigned delay_min = 1000, unsigned delay_max = 300000) :
+        delay_min(delay_min), delay_max(delay_max), seed(0) { }
+
+    bool IsPending(const acdPatchKey &key, uint64_t now) const;
+
+    // Returns the delay (ms) before the next attempt.
+    unsigned Failure(const acdPatchKey &key, int error, uint64_t now);
+    void Reject(const acdPatchKey &key, int error);
+    inline void Success(const acdPatchKey &key) { entries.erase(key); }
+
+    // Topology of the endpoint changed; retry the patches using it.  The
+    // patches reset are added to keys if given.
+    size_t Reset(acdNameId client, acdNameId port = acdNameTable::invalid,
+        set<acdPatchKey> *keys = NULL);
+    inline void Clear(void) { entries.clear(); }
+
+    bool NextRetry(uint64_t &when) const;
+
+    inline const map<acdPatchKey, Entry> &Entries(void) const { return entries; }
+
+protected:
+    unsigned delay_min;
+    unsigned delay_max;
+    unsigned seed;
+    map<acdPatchKey, Entry> entries;
+};
+
+// Subscriptions created by aconnectd, keyed by endpoint names so that
+// ownership survives client id reuse and restarts.
+class acdLedger
+{
+public:
+    acdLedger() : dirty(false) { }
+
+    inline bool Owns(const acdPatchKey &key) const {
+        return (owned.find(key) != owned.end());
+    }
+
+    void Insert(const acdPatchKey &key);
+    void Erase(const acdPatchKey &key);
+    // Drops entries that aren't in patches.
+    void Prune(const map<acdPatchKey, acdPatch> &patches);
+
+    inline bool IsDirty(void) const { return dirty; }
+    inline size_t Size(void) const { return owned.size(); }
+
+    bool Load(const string &filename, acdNameTable &names);
+    // Written to a temporary file, then renamed over filename.
+    bool Save(const string &filename, const acdNameTable &names);
+
+protected:
+    set<acdPatchKey> owned;
+    bool dirty;
+};
+
+// Log-linear histogram of microsecond values: exact below 4, then four
+// buckets per power of two.  Values from 7 * 2^22 (about 29 s) share the
+// last bucket.
+#define ACD_HISTOGRAM_BUCKETS   96
+
+class acdHistogram
+{
+public:
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+
+    acdHistogram() { Clear(); }
+
+    void Clear(void);
+    void Record(uint64_t value);
+
+    // Upper bound of the bucket holding the p-th percentile (0..100),
+    // clamped to the largest value recorded.
+    uint64_t Percentile(double p) const;
+
+    static unsigned Bucket(uint64_t value);
+    static uint64_t BucketUpper(unsigned bucket);
+
+    inline uint32_t Count(unsigned bucket) const { return buckets[bucket]; }
+
+    void Print(FILE *fh, const char *prefix) const;
+
+protected:
+    uint32_t buckets[ACD_HISTOGRAM_BUCKETS];
+};
+
+// Latency from an endpoint appearing (announce or enumeration) to the
+// subscriptions of its patches being in place.  Each patch is measured
+// once per appearance of its endpoints, resubscribing an unchanged
+// topology isn't a new sample.
+class acdLatency
+{
+public:
+    class Entry
+    {
+    public:
+        // Appearance time of the later endpoint at the last sample.
+        uint64_t ready;
+        acdHistogram histogram;
+
+        Entry() : ready(0) { }
+    };
+
+    void Appear(const acdEndpointKey &key, uint64_t now);
+    inline void Gone(const acdEndpointKey &key) { appeared.erase(key); }
+    // Drops the stamps of endpoints that no longer resolve.
+    void Retain(const acdAddressIndex &index);
+
+    void Record(const acdPatchKey &key, uint64_t now);
+    // Drops the patches that aren't in patches.
+    void Prune(const map<acdPatchKey, acdPatch> &patches);
+
+    inline const acdHistogram &Overall(void) const { return overall; }
+    inline const map<acdPatchKey, Entry> &Entries(void) const { return entries; }
+
+protected:
+    acdHistogram overall;
+    map<acdPatchKey, Entry> entries;
+    unordered_map<acdEndpointKey, uint64_t, acdEndpointKeyHash> appeared;
+};
+
+// Samples kept per phase for the rolling figures.
+#define ACD_STATS_WINDOW        128
+
+// Wall and CPU time of each phase of a cycle, with the sequencer calls it
+// made.  Nested phases are accounted to the outermost one.
+class acdStats
+{
+public:
+    enum Phase {
+        phREFRESH,
+        phEVENTS,
+        phRESOLVE,
+        phPLAN,
+        phREMOVE,
+        phADD,
+        phCOUNT
+    };
+
+    enum Call {
+        caQUERY_CLIENT,
+        caGET_CLIENT,
+        caQUERY_PORT,
+        caGET_PORT,
+        caQUERY_SUBSCRIBERS,
+        caSUBSCRIBE,
+        caUNSUBSCRIBE,
+        caCOUNT
+    };
+
+    class Sample
+    {
+    public:
+        uint64_t wall_ns;
+        uint64_t cpu_ns;
+        uint32_t calls[caCOUNT];
+    };
+
+    // Rolling min, avg, max and p99 over the window.
+    class Summary
+    {
+    public:
+        uint64_t min;
+        uint64_t avg;
+        uint64_t max;
+        uint64_t p99;
+    };
+
+    acdStats();
+
+    void Begin(enum Phase phase);
+    void End(void);
+
+    inline void Count(enum Call call) { pending.calls[call]++; }
+
+    inline uint64_t Cycles(enum Phase phase) const { return cycles[phase]; }
+    inline uint64_t Total(enum Phase phase, enum Call call) const {
+        return totals[phase][call];
+    }
+
+    Summary Wall(enum Phase phase) const;
+    Summary Cpu(enum Phase phase) const;
+    Summary Calls(enum Phase phase, enum Call call) const;
+
+    static const char *PhaseName(enum Phase phase);
+    static const char *CallName(enum Call call);
+
+    void Print(FILE *fh) const;
+
+protected:
+    Summary Summarize(enum Phase phase,
+        function<uint64_t(const Sample &)> value) const;
+
+    unsigned depth;
+    enum Phase phase;
+    uint64_t wall_start;
+    uint64_t cpu_start;
+    // Calls since Begin(), and outside any phase.
+    Sample pending;
+
+    uint64_t cycles[phCOUNT];
+    uint64_t totals[phCOUNT][caCOUNT];
+    vector<Sample> window[phCOUNT];
+    size_t next[phCOUNT];
+};
+
+// Counts the calls to another backend in acdStats.
+class acdSequencerCounter : public acdSequencer
+{
+public:
+    acdSequencerCounter(acdSequencer *seq, acdStats &stats) :
+        seq(seq), stats(stats) { }
+
+    virtual int ClientId(void) { return seq->ClientId(); }
+
+    virtual int QueryNextClient(acdSeqClientInfo &info);
+    virtual int GetClientInfo(int client, acdSeqClientInfo &info);
+
+    virtual int QueryNextPort(acdSeqPortInfo &info);
+    virtual int GetPortInfo(int client, int port, acdSeqPortInfo &info);
+
+    virtual int QuerySubscribers(const snd_seq_addr_t &root,
+        snd_seq_query_subs_type_t type, int index, snd_seq_addr_t &addr);
+
+    virtual int Subscribe(const snd_seq_addr_t &src, const snd_seq_addr_t &dst,
+        int queue, bool exclusive, int convert_time, int convert_real);
+    virtual int Unsubscribe(const snd_seq_addr_t &src, const snd_seq_addr_t &dst);
+
+    virtual int SubscribeAnnounce(void) { return seq->SubscribeAnnounce(); }
+    virtual int EventInput(acdSeqEvent &event) { return seq->EventInput(event); }
+    virtual int PollDescriptors(vector<struct pollfd> &pfds) {
+        return seq->PollDescriptors(pfds);
+    }
+
+protected:
+    acdSequencer *seq;
+    acdStats &stats;
 };
 
-typedef map<pair<string, string>, acdSubscription> acdSubMap;
+class acdReconciler
+{
+public:
+    // Whether an observed subscription without a patch may be removed.
+    typedef function<bool(const acdPatchKey &key)> Filter;
+
+    // Sorted-merge of the desired patches against the observed
+    // subscriptions; both maps share the acdPatchKey ordering.  Only
+    // patches with both endpoints present are planned.  Unsubscribe
+    // operations are ordered first so exclusive patches can take over.
+    static void Plan(
+        const map<acdPatchKey, acdPatch> &patches,
+        const acdSubMap &subscriptions,
+        const acdAddressIndex &index, acdPlan &plan,
+        const Filter &managed = Filter());
+
+    // Subscribe operations for patches in backoff are skipped; results
+    // are recorded in the backoff state.
+    static size_t Apply(acdContext &ctx, const acdPlan &plan, uint64_t now);
+
+    static void Print(FILE *fh,
+        const acdNameTable &names, const acdPlan &plan);
+};
 
 class acdSubscription
 {
@@ -116,9 +999,11 @@ public:
         dst_client(dst_client), dst_port(dst_port),
         type(type) { }
 
-    inline void MakeKey(pair<string, string> &key) const {
-        key.first = src_client.name + "/" + src_port.name;
-        key.second = dst_client.name + "/" + dst_port.name;
+    inline acdPatchKey MakeKey(void) const {
+        return acdPatchKey(
+            acdEndpointKey(src_client.name_id, src_port.name_id),
+            acdEndpointKey(dst_client.name_id, dst_port.name_id)
+        );
     }
 
     enum AddrType {
@@ -127,27 +1012,340 @@ public:
     };
 
     static bool GetAddress(
-        snd_seq_t *seq, const acdPatch &patch,
+        const acdAddressIndex &index, const acdPatch &patch,
         snd_seq_addr_t &addr, enum AddrType atype
     );
-    static bool GetAddress(
-        snd_seq_t *seq, const acdSubscription &subscription,
+    static void GetAddress(
+        const acdSubscription &subscription,
         snd_seq_addr_t &addr, enum AddrType atype
     );
 
-    static bool Add(snd_seq_t *seq, const acdPatch &patch);
-    static bool Remove(snd_seq_t *seq, const acdSubscription &subscription);
+    static bool Add(acdContext &ctx, const acdPlanOp &op);
+    static bool Remove(acdContext &ctx, const acdPlanOp &op);
 
     enum ExecType {
         etSUBSCRIBE,
         etUNSUBSCRIBE
     };
 
-    static bool Execute(
-        snd_seq_t *seq, snd_seq_port_subscribe_t *sub,
-        snd_seq_addr_t &src, snd_seq_addr_t &dst, enum ExecType etype);
+    static bool Execute(acdSequencer *seq, const acdPatch *patch,
+        const snd_seq_addr_t &src, const snd_seq_addr_t &dst,
+        enum ExecType etype);
+};
+
+class acdEventLoop
+{
+public:
+    typedef function<void(uint32_t events)> Handler;
+
+    acdEventLoop() : fd_epoll(-1), busy_since(0), lag_us(0), lag_max_us(0) { }
+    virtual ~acdEventLoop();
+
+    bool Create(void);
+
+    bool Add(int fd, uint32_t events, Handler handler);
+    bool Modify(int fd, uint32_t events);
+    bool Remove(int fd);
+
+    int Dispatch(int timeout = -1);
+
+    // Time (us) between the previous wakeup and the loop waiting again,
+    // the longest a ready descriptor waited for it.
+    inline uint64_t Lag(void) const { return lag_us.load(memory_order_relaxed); }
+    inline uint64_t LagMax(void) const {
+        return lag_max_us.load(memory_order_relaxed);
+    }
+
+protected:
+    int fd_epoll;
+    map<int, Handler> handlers;
+    uint64_t busy_since;
+    atomic<uint64_t> lag_us;
+    atomic<uint64_t> lag_max_us;
+};
+
+// Daemon counters, updated on the hot path and read by the metrics
+// endpoint; see acdMetricsServer.
+class acdMetrics
+{
+public:
+    atomic<uint64_t> reconciles;
+    atomic<uint64_t> reconcile_us;
+    atomic<uint64_t> reconcile_last_us;
+    atomic<uint64_t> subscribed;
+    atomic<uint64_t> unsubscribed;
+    atomic<uint64_t> failed;
+
+    acdMetrics() : reconciles(0), reconcile_us(0), reconcile_last_us(0),
+        subscribed(0), unsubscribed(0), failed(0) { }
+
+    inline void Reconciled(uint64_t us) {
+        reconciles.fetch_add(1, memory_order_relaxed);
+        reconcile_us.fetch_add(us, memory_order_relaxed);
+        reconcile_last_us.store(us, memory_order_relaxed);
+    }
+
+    inline void Count(atomic<uint64_t> &counter) {
+        counter.fetch_add(1, memory_order_relaxed);
+    }
+};
+
+// Writer of the status page, see aconnectd-status.h.
+struct acd_status_header;
+class acdStatusPage
+{
+public:
+    acdStatusPage() : fd(-1), page(NULL), length(0), generation(0),
+        synced(false), totals_ms(0), ports(0), subscriptions(0) { }
+    virtual ~acdStatusPage();
+
+    bool Open(const string &filename);
+    void Close(void);
+
+    inline bool IsOpen(void) const { return (page != NULL); }
+
+    // Rewrites every patch record.
+    void Publish(const acdContext &ctx);
+    // Only rewrites the records of the given patches (adding or dropping
+    // them as needed) and the header.
+    void Publish(const acdContext &ctx, const set<acdPatchKey> &keys);
+
+protected:
+    // Grows the file and the mapping to hold patches.
+    bool Reserve(size_t patches);
+    // Both within the seqlock.
+    void Header(const acdContext &ctx, bool totals);
+    void Record(const acdContext &ctx, const acdPatchKey &key,
+        const acdPatch &patch, bool disabled, struct acd_status_patch *record);
+
+    int fd;
+    struct acd_status_header *page;
+    size_t length;
+    uint64_t generation;
+    // The records match slots since the last full publish.
+    bool synced;
+    map<acdPatchKey, uint32_t> slots;
+    vector<acdPatchKey> slot_keys;
+    // Port and subscription counts walk the whole topology, they are
+    // only recounted every ACD_STATUS_TOTALS_MS between full publishes.
+    uint64_t totals_ms;
+    uint32_t ports;
+    uint32_t subscriptions;
+};
+
+// Patch management state for one sequencer client, with no global state so
+// several contexts can run side by side.  The sequencer isn't owned; hosts
+// that read sequencer events themselves pass announce events to
+// ProcessEvent() instead of calling ProcessEvents().
+class acdContext
+{
+public:
+    acdConfig config;
+    acdNameTable names;
+    map<int, acdClient> clients;
+    acdInstances instances;
+    acdAddressIndex address_index;
+    // The sources subscribed to each destination address, the reverse of
+    // acdPort::subscribers, so that a peer leaving only visits its own
+    // subscriptions.  Destinations needn't be known ports; sources gone
+    // since are harmless and dropped with their destination.
+    map<acdSubAddr, set<acdSubAddr>> senders;
+    acdSubMap sub_map;
+    acdBackoff backoff;
+    acdLedger ledger;
+    // Where the ledger is persisted, if not empty.
+    string ledger_file;
+    acdLatency latency;
+    acdStats stats;
+    acdMetrics metrics;
+    // Updated after each reconcile once opened.
+    acdStatusPage status_page;
+
+    // Calls to seq are counted in stats.
+    acdContext(acdSequencer *seq) :
+        counter(seq, stats), seq(&counter), touched_all(false) {
+        config.my_id = seq->ClientId();
+    }
+
+    inline acdSequencer *Sequencer(void) const { return seq; }
+
+    void Refresh(void);
+    void RefreshSubscriptions(void);
+
+    // Loads the file into a new configuration and only reconciles the
+    // patches that were added, removed or changed.  A broken file is
+    // rejected and the active configuration kept.
+    bool Reload(const string &filename);
+
+    bool ProcessEvents(void);
+    bool ProcessEvent(const acdSeqEvent &event);
+
+    void ResolveSubscriptions(void);
+    void Reconcile(const map<acdPatchKey, acdPatch> &patches);
+    void Reconcile(void);
+    // Only plans the given patches, against the current topology.
+    void Reconcile(const set<acdPatchKey> &keys);
+    // Only plans the patches touched by topology events since the last
+    // full reconcile, or all of them after a refresh.
+    void ReconcileTouched(void);
+
+    // Runtime patch changes, applied by the next Reconcile().  Adding an
+    // existing patch replaces its options and enables it.  Return false
+    // if the patch doesn't exist.
+    void AddPatch(const acdPatch &patch);
+    bool RemovePatch(const acdPatchKey &key);
+    bool EnablePatch(const acdPatchKey &key);
+    bool DisablePatch(const acdPatchKey &key);
+
+    void StatusDump(FILE *fh) const;
+
+    // Applies the configured policy, see acdConfig::Policy.
+    bool IsManaged(const acdPatchKey &key) const;
+
+    // Handoff between instances: the patched subscriptions in place are
+    // written on exit, and the next instance adopts (takes ownership of)
+    // those that are still there after its first refresh.  The snapshot
+    // is consumed by SnapshotAdopt().
+    bool SnapshotSave(const string &filename) const;
+    size_t SnapshotAdopt(const string &filename);
+
+    // Incremental topology updates; each returns true on a change.
+    bool TopologyClient(int client_id);
+    bool TopologyClientExit(int client_id);
+    bool TopologyPort(int client_id, int port_id);
+    bool TopologyPortExit(int client_id, int port_id);
+    // Own changes are the daemon's Add() and Remove().
+    bool TopologySubscription(const snd_seq_addr_t &src,
+        const snd_seq_addr_t &dst, bool subscribed, bool own = false);
+
+    const acdPort *TopologyFind(const snd_seq_addr_t &addr) const;
+
+    inline void SenderAdd(const snd_seq_addr_t &src, const acdSubAddr &dst) {
+        senders[dst].insert(acdSubAddr(src.client, src.port));
+    }
+
+    inline void SenderRemove(const snd_seq_addr_t &src, const acdSubAddr &dst) {
+        auto it = senders.find(dst);
+        if (it == senders.end()) return;
+        it->second.erase(acdSubAddr(src.client, src.port));
+        if (it->second.empty()) senders.erase(it);
+    }
+    bool TopologySubscribable(const snd_seq_addr_t &src,
+        const snd_seq_addr_t &dst) const;
+
+protected:
+    // Client ids are reused, drop subscribers that have gone away.
+    void TopologyPurge(int client_id, int port_id = -1);
+
+    void SourceAdd(const acdEndpointKey &key);
+    void SourceRemove(const acdEndpointKey &key);
+    void SourceFlush(void);
+    void LedgerSave(void);
+    void RefreshSubscriptions(const acdEndpointKey &key);
+    // An endpoint name resolves, or stopped resolving: stamps latency and
+    // expands the rules.
+    // Changed endpoints were already present, with other attributes.
+    void EndpointAppear(const acdPort &port, uint64_t now, bool changed = false);
+    void EndpointAppear(const acdClient &client, uint64_t now, bool changed = false);
+    void EndpointGone(const acdEndpointKey &key);
+    bool EndpointPresent(const acdEndpointKey &key) const;
+    void RuleAdd(const acdRuleIndex::Match &match);
+    void RuleRemove(const acdPatchKey &key);
+    // Expands the rules of a configuration being loaded.
+    void RuleExpand(acdConfig &next);
+    // Marks the patches of an endpoint, and the subscriptions of a port,
+    // for ReconcileTouched().
+    void Touch(const acdEndpointKey &key);
+    void Touch(const acdPort &port);
+
+    // Sources no longer verified, see SourceRemove().
+    set<acdEndpointKey> sources_dropped;
+
+    acdSequencerCounter counter;
+    acdSequencer *seq;
+    set<acdPatchKey> touched;
+    bool touched_all;
 };
 
+// A client of the control socket or of the metrics server.
+class acdConnection
+{
+public:
+    // Pending input, and replies the socket didn't take yet.
+    string input;
+    string output;
+    // Polled for EPOLLOUT.
+    bool writing;
+
+    acdConnection() : writing(false) { }
+};
+
+// Local control socket, one JSON request and reply per line: add, remove,
+// enable, disable, batch, list, status, latency, stats and
+// reconcile (see README).
+class acdControl
+{
+public:
+    typedef function<void(void)> Handler;
+
+    acdControl(acdContext &ctx, acdEventLoop &loop) :
+        ctx(ctx), loop(loop), fd_listen(-1) { }
+    virtual ~acdControl();
+
+    bool Open(const string &path);
+    void Close(void);
+
+    // Called after requests changed patches or subscriptions.
+    Handler changed;
+
+protected:
+    void Accept(void);
+    void Input(int fd);
+    // Returns false if the connection was dropped.
+    bool Output(int fd);
+    void Disconnect(int fd);
+
+    // Returns true if the request changed anything.
+    bool Execute(const string &line, string &response);
+
+    acdContext &ctx;
+    acdEventLoop &loop;
+    int fd_listen;
+    string path;
+    map<int, acdConnection> connections;
+};
+
+// Prometheus text exposition over HTTP, on a Unix socket (an absolute
+// path) or a loopback TCP port ("port" or "localhost:port").  Metrics are
+// formatted per scrape only.
+class acdMetricsServer
+{
+public:
+    acdMetricsServer(acdContext &ctx, acdEventLoop &loop) :
+        ctx(ctx), loop(loop), fd_listen(-1) { }
+    virtual ~acdMetricsServer();
+
+    bool Open(const string &address);
+    void Close(void);
+
+    void Format(string &text) const;
+
+protected:
+    void Accept(void);
+    void Input(int fd);
+    void Output(int fd);
+    void Disconnect(int fd);
+
+    acdContext &ctx;
+    acdEventLoop &loop;
+    int fd_listen;
+    string path;
+    map<int, acdConnection> connections;
+};
+
+uint64_t acd_time_ms(void);
+uint64_t acd_time_us(void);
+
 #endif // _ACONNECTD_H
 
 // vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,2239 @@
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <map>
+#include <set>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+
+#include <cstdio>
+#include <cctype>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <cstdarg>
+#include <ctime>
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+
+#include <alsa/asoundlib.h>
+
+#include "nlohmann/json.hpp"
+using json = nlohmann::json;
+
+using namespace std;
+
+#include "aconnectd.h"
+
+bool acdConfig::Load(const string &filename, acdNameTable &names)
+{
+    json j;
+    ifstream ifs(filename);
+    if (! ifs.is_open()) {
+        fprintf(stderr, "Error loading configuration: %s: %s\n",
+            filename.c_str(), strerror(ENOENT));
+        return false;
+    }
+
+    try {
+        ifs >> j;
+    }
+    catch (exception &e) {
+        fprintf(stderr, "Error loading configuration: %s: JSON parse error\n",
+            filename.c_str());
+        return false;
+    }
+
+    // Nothing is changed unless the whole file is valid.
+    map<acdPatchKey, acdPatch> next_patches, next_disabled;
+    acdRuleIndex next_rules;
+    vector<acdMatrix> next_matrices;
+    size_t index = 0;
+
+    try {
+        if (j.count("patches") && ! j["patches"].is_array())
+            throw invalid_argument("patches");
+
+        for (auto &it : j["patches"]) {
+            bool enabled;
+            acdRule rule;
+
+            if (acd_rule_parse(it, rule, enabled)) {
+                if (enabled) next_rules.Add(rule);
+                index++;
+                continue;
+            }
+
+            acdPatch patch = acd_patch_parse(it, names, enabled);
+
+            // An enabled duplicate wins.
+            if (enabled) {
+                next_patches.insert(make_pair(patch.MakeKey(), patch));
+                next_disabled.erase(patch.MakeKey());
+            }
+            else if (next_patches.find(patch.MakeKey()) == next_patches.end())
+                next_disabled.insert(make_pair(patch.MakeKey(), patch));
+
+            index++;
+        }
+    }
+    catch (exception &e) {
+        fprintf(stderr, "Error loading configuration: %s: invalid patch %zu\n",
+            filename.c_str(), index);
+        return false;
+    }
+
+    index = 0;
+
+    try {
+        if (j.count("matrices") && ! j["matrices"].is_array())
+            throw invalid_argument("matrices");
+
+        for (auto &it : j["matrices"]) {
+            bool enabled;
+            acdMatrix matrix;
+
+            acd_matrix_parse(it, matrix, enabled);
+            if (enabled) next_matrices.push_back(matrix);
+
+            index++;
+        }
+    }
+    catch (exception &e) {
+        fprintf(stderr, "Error loading configuration: %s: invalid matrix %zu\n",
+            filename.c_str(), index);
+        return false;
+    }
+
+    enum Policy next_policy = poTAKEOVER;
+    unordered_set<acdNameId> next_scope;
+
+    try {
+        if (j.count("policy")) {
+            string name = j["policy"].get<string>();
+
+            if (name == "owned")
+                next_policy = poOWNED;
+            else if (name == "scoped")
+                next_policy = poSCOPED;
+            else if (name != "takeover")
+                throw invalid_argument(name);
+        }
+
+        for (auto &it : j["scope"])
+            next_scope.insert(names.Intern(it.get<string>()));
+    }
+    catch (exception &e) {
+        fprintf(stderr, "Error loading configuration: %s: invalid policy\n",
+            filename.c_str());
+        return false;
+    }
+
+    refresh_ttl = 0;
+    targeted_verify = false;
+
+    try {
+        refresh_ttl = j["refresh_ttl"].get<unsigned>();
+    } catch (...) { }
+
+    try {
+        targeted_verify = j["targeted_verify"].get<bool>();
+    } catch (...) { }
+
+    handoff = false;
+
+    try {
+        handoff = j["handoff"].get<bool>();
+    } catch (...) { }
+
+    policy = next_policy;
+    scope.swap(next_scope);
+    patches.swap(next_patches);
+    disabled.swap(next_disabled);
+    rules.Swap(next_rules);
+    matrices.swap(next_matrices);
+    // Filled in as endpoints appear.
+    expanded.clear();
+
+    sources.clear();
+    dependents.clear();
+
+    for (auto &it : patches) {
+        sources[it.first.first]++;
+        DependentAdd(it.first);
+    }
+
+    return true;
+}
+
+static void acd_patch_options(const json &it, int &queue,
+    int &convert_real, int &convert_time, bool &exclusive, bool &enabled)
+{
+    queue = 0;
+    convert_real = 0;
+    convert_time = 0;
+    exclusive = false;
+    enabled = true;
+
+    try {
+        enabled = it.at("enabled").get<bool>();
+    } catch (...) { }
+
+    try {
+        string mode = it.at("convert_time_mode").get<string>();
+        if (mode == "real") {
+            convert_time = 1;
+            convert_real = 1;
+        }
+        else if (mode == "tick") {
+            convert_time = 1;
+            convert_real = 0;
+        }
+
+        queue = it.at("convert_time_queue").get<int>();
+    } catch (...) { }
+
+    try {
+        exclusive = it.at("exclusive").get<bool>();
+    } catch (...) { }
+}
+
+acdPatch acd_patch_parse(const json &it, acdNameTable &names, bool &enabled)
+{
+    int queue, convert_real, convert_time;
+    bool exclusive;
+
+    acd_patch_options(it, queue, convert_real, convert_time, exclusive, enabled);
+
+    return acdPatch(names,
+        it.at("src_client").get<string>(),
+        it.at("src_port").get<string>(),
+        it.at("dst_client").get<string>(),
+        it.at("dst_port").get<string>(),
+        queue, convert_real, convert_time, exclusive
+    );
+}
+
+struct acd_attribute_bit {
+    const char *name;
+    unsigned bit;
+};
+
+static const struct acd_attribute_bit acd_capabilities[] = {
+    { "read", SND_SEQ_PORT_CAP_READ },
+    { "write", SND_SEQ_PORT_CAP_WRITE },
+    { "sync_read", SND_SEQ_PORT_CAP_SYNC_READ },
+    { "sync_write", SND_SEQ_PORT_CAP_SYNC_WRITE },
+    { "duplex", SND_SEQ_PORT_CAP_DUPLEX },
+    { "subs_read", SND_SEQ_PORT_CAP_SUBS_READ },
+    { "subs_write", SND_SEQ_PORT_CAP_SUBS_WRITE },
+    { "no_export", SND_SEQ_PORT_CAP_NO_EXPORT },
+    { NULL, 0 }
+};
+
+static const struct acd_attribute_bit acd_port_types[] = {
+    { "specific", SND_SEQ_PORT_TYPE_SPECIFIC },
+    { "midi_generic", SND_SEQ_PORT_TYPE_MIDI_GENERIC },
+    { "midi_gm", SND_SEQ_PORT_TYPE_MIDI_GM },
+    { "midi_gs", SND_SEQ_PORT_TYPE_MIDI_GS },
+    { "midi_xg", SND_SEQ_PORT_TYPE_MIDI_XG },
+    { "midi_mt32", SND_SEQ_PORT_TYPE_MIDI_MT32 },
+    { "midi_gm2", SND_SEQ_PORT_TYPE_MIDI_GM2 },
+    { "synth", SND_SEQ_PORT_TYPE_SYNTH },
+    { "direct_sample", SND_SEQ_PORT_TYPE_DIRECT_SAMPLE },
+    { "sample", SND_SEQ_PORT_TYPE_SAMPLE },
+    { "hardware", SND_SEQ_PORT_TYPE_HARDWARE },
+    { "software", SND_SEQ_PORT_TYPE_SOFTWARE },
+    { "synthesizer", SND_SEQ_PORT_TYPE_SYNTHESIZER },
+    { "port", SND_SEQ_PORT_TYPE_PORT },
+    { "application", SND_SEQ_PORT_TYPE_APPLICATION },
+    { NULL, 0 }
+};
+
+// All the named bits must be set.
+static unsigned acd_attribute_bits(const json &it,
+    const struct acd_attribute_bit *bits)
+{
+    unsigned mask = 0;
+
+    for (auto &name : it) {
+        const struct acd_attribute_bit *b = bits;
+        while (b->name != NULL && name.get<string>() != b->name) b++;
+
+        if (b->name == NULL) throw invalid_argument(name.get<string>());
+
+        mask |= b->bit;
+    }
+
+    return mask;
+}
+
+static void acd_attributes_parse(const json &it,
+    vector<acdPredicate> &predicates)
+{
+    if (! it.is_object()) throw invalid_argument("attributes");
+
+    for (auto attr = it.begin(); attr != it.end(); attr++) {
+        const string &key = attr.key();
+
+        if (key == "client_type") {
+            string type = attr->get<string>();
+
+            if (type != "kernel" && type != "user") throw invalid_argument(type);
+
+            predicates.push_back(acdPredicate(acdPredicate::pfCLIENT_TYPE, ~0u,
+                (type == "kernel") ? SND_SEQ_KERNEL_CLIENT : SND_SEQ_USER_CLIENT));
+        }
+        else if (key == "card") {
+            predicates.push_back(acdPredicate(acdPredicate::pfCARD, ~0u,
+                (unsigned)attr->get<int>()));
+        }
+        else if (key == "pid") {
+            predicates.push_back(acdPredicate(acdPredicate::pfPID, ~0u,
+                (unsigned)attr->get<int>()));
+        }
+        else if (key == "capability") {
+            unsigned mask = acd_attribute_bits(*attr, acd_capabilities);
+            predicates.push_back(acdPredicate(acdPredicate::pfCAPABILITY, mask, mask));
+        }
+        else if (key == "type") {
+            unsigned mask = acd_attribute_bits(*attr, acd_port_types);
+            predicates.push_back(acdPredicate(acdPredicate::pfTYPE, mask, mask));
+        }
+        else
+            throw invalid_argument(key);
+    }
+}
+
+// A side with attributes matches any name unless one is given.
+static void acd_rule_name(const json &it, const char *key,
+    bool attributes, bool literal, acdMatcher &matcher)
+{
+    if (attributes && it.count(key) == 0)
+        matcher.Compile("*");
+    else
+        matcher.Compile(it.at(key).get<string>(), literal);
+}
+
+bool acd_rule_parse(const json &it, acdRule &rule, bool &enabled)
+{
+    bool literal = false;
+
+    try {
+        string match = it.at("match").get<string>();
+        if (match == "exact")
+            literal = true;
+        else if (match != "pattern")
+            throw invalid_argument(match);
+    } catch (json::out_of_range &e) { }
+
+    bool src_attributes = (it.count("src_attributes") > 0);
+    bool dst_attributes = (it.count("dst_attributes") > 0);
+
+    if (! src_attributes && ! dst_attributes) {
+        if (literal) return false;
+
+        if (! acdMatcher::IsPattern(it.at("src_client").get<string>()) &&
+            ! acdMatcher::IsPattern(it.at("src_port").get<string>()) &&
+            ! acdMatcher::IsPattern(it.at("dst_client").get<string>()) &&
+            ! acdMatcher::IsPattern(it.at("dst_port").get<string>()))
+            return false;
+    }
+
+    if (src_attributes) acd_attributes_parse(it.at("src_attributes"), rule.src_attributes);
+    if (dst_attributes) acd_attributes_parse(it.at("dst_attributes"), rule.dst_attributes);
+
+    acd_rule_name(it, "src_client", src_attributes, literal, rule.src_client);
+    acd_rule_name(it, "src_port", src_attributes, literal, rule.src_port);
+    acd_rule_name(it, "dst_client", dst_attributes, literal, rule.dst_client);
+    acd_rule_name(it, "dst_port", dst_attributes, literal, rule.dst_port);
+
+    acd_patch_options(it, rule.queue, rule.convert_real, rule.convert_time,
+        rule.exclusive, enabled);
+
+    return true;
+}
+
+// The template variables of the rows that use them.
+static void acd_matrix_rows(const json &it, const map<string, unsigned> &variables,
+    vector<vector<string>> &rows)
+{
+    if (! it.is_array()) throw invalid_argument("rows");
+
+    for (auto &row : it) {
+        if (! row.is_object()) throw invalid_argument("row");
+
+        vector<string> values(variables.size());
+
+        for (auto value = row.begin(); value != row.end(); value++) {
+            auto variable = variables.find(value.key());
+            if (variable == variables.end()) continue;
+
+            values[variable->second] = value->get<string>();
+            if (values[variable->second].empty())
+                throw invalid_argument(value.key());
+        }
+
+        rows.push_back(values);
+    }
+}
+
+void acd_matrix_parse(const json &it, acdMatrix &matrix, bool &enabled)
+{
+    matrix.src_client.Compile(it.at("src_client").get<string>(), matrix.variables);
+    matrix.src_port.Compile(it.at("src_port").get<string>(), matrix.variables);
+    matrix.dst_client.Compile(it.at("dst_client").get<string>(), matrix.variables);
+    matrix.dst_port.Compile(it.at("dst_port").get<string>(), matrix.variables);
+
+    acd_matrix_rows(it.at("sources"), matrix.variables, matrix.rows[acdMatrix::sdSRC]);
+    acd_matrix_rows(it.at("destinations"), matrix.variables, matrix.rows[acdMatrix::sdDST]);
+
+    matrix.Index();
+
+    acd_patch_options(it, matrix.queue, matrix.convert_real, matrix.convert_time,
+        matrix.exclusive, enabled);
+}
+
+void acdNameTable::Normalize(const string &name, string &normalized)
+{
+    size_t length = name.find_last_not_of(" \t");
+    normalized.assign(name, 0, (length == string::npos) ? 0 : length + 1);
+}
+
+acdNameId acdNameTable::Intern(const string &name)
+{
+    string normalized;
+    Normalize(name, normalized);
+
+    auto it = ids.find(normalized);
+    if (it != ids.end()) return it->second;
+
+    acdNameId id = (acdNameId)names.size();
+    names.push_back(normalized);
+    ids.insert(make_pair(normalized, id));
+
+    return id;
+}
+
+acdNameId acdNameTable::Find(const string &name) const
+{
+    string normalized;
+    Normalize(name, normalized);
+
+    auto it = ids.find(normalized);
+    if (it == ids.end()) return invalid;
+
+    return it->second;
+}
+
+acdNameId acdInstances::Assign(acdNameTable &names,
+    int client_id, acdNameId name_id)
+{
+    auto it = clients.find(client_id);
+
+    if (it != clients.end()) {
+        if (it->second.name_id == name_id) return it->second.instance_id;
+        Release(client_id);
+    }
+
+    set<unsigned> &taken = numbers[name_id];
+    unsigned number = 1;
+
+    while (taken.count(number) > 0) number++;
+    taken.insert(number);
+
+    Instance &instance = clients[client_id];
+    instance.name_id = name_id;
+    instance.number = number;
+    instance.instance_id = (number == 1) ? name_id :
+        names.Intern(names.Name(name_id) + "#" + to_string(number));
+
+    return instance.instance_id;
+}
+
+void acdInstances::Release(int client_id)
+{
+    auto it = clients.find(client_id);
+    if (it == clients.end()) return;
+
+    auto it_numbers = numbers.find(it->second.name_id);
+    it_numbers->second.erase(it->second.number);
+    if (it_numbers->second.empty()) numbers.erase(it_numbers);
+
+    clients.erase(it);
+}
+
+void acdInstances::Retain(acdNameTable &names,
+    const vector<acdSeqClientInfo> &infos)
+{
+    unordered_map<int, acdNameId> present;
+
+    for (auto &info : infos) present[info.client] = names.Intern(info.name);
+
+    vector<int> gone;
+
+    for (auto &it : clients) {
+        auto it_present = present.find(it.first);
+        if (it_present == present.end() || it_present->second != it.second.name_id)
+            gone.push_back(it.first);
+    }
+
+    for (auto client_id : gone) Release(client_id);
+}
+
+size_t acdClient::RefreshPorts(acdContext &ctx)
+{
+    acdSequencer *seq = ctx.Sequencer();
+
+    ports.clear();
+
+    acdSeqPortInfo info;
+    info.client = id;
+
+    while (seq->QueryNextPort(info) >= 0) {
+        acdPort port(ctx.names, *this, info);
+
+        auto it = ports.insert(make_pair(port.id, port));
+
+        if (it.second == true) {
+            if (ctx.config.verbose) {
+                fprintf(stdout, "Inserted port: %d: %s\n",
+                    port.id, port.name.c_str()
+                );
+            }
+
+            it.first->second.RefreshSubscriptions(ctx);
+        }
+    }
+
+    return ports.size();
+}
+
+bool acdClient::RefreshPort(acdContext &ctx, int port_id)
+{
+    acdSequencer *seq = ctx.Sequencer();
+    acdSeqPortInfo info;
+
+    if (seq->GetPortInfo(id, port_id, info) < 0)
+        return (ports.erase(port_id) > 0);
+
+    acdPort port(ctx.names, *this, info);
+
+    auto it = ports.find(port.id);
+
+    if (it == ports.end()) {
+        it = ports.insert(make_pair(port.id, port)).first;
+
+        if (ctx.config.verbose) {
+            fprintf(stdout, "Inserted port: %d: %s\n",
+                port.id, port.name.c_str()
+            );
+        }
+    }
+    else {
+        it->second.name = port.name;
+        it->second.name_id = port.name_id;
+        it->second.capability = port.capability;
+        it->second.type = port.type;
+    }
+
+    it->second.RefreshSubscriptions(ctx);
+
+    return true;
+}
+
+size_t acdPort::RefreshSubscriptions(acdContext &ctx)
+{
+    subscribers.clear();
+
+    if (! ctx.config.IsVerified(acdEndpointKey(client.name_id, name_id)))
+        return 0;
+
+    size_t count = 0;
+    count += AddSubscriptions(ctx, SND_SEQ_QUERY_SUBS_READ);
+    //count += AddSubscriptions(ctx, SND_SEQ_QUERY_SUBS_WRITE);
+
+    return count;
+}
+
+size_t acdPort::AddSubscriptions(acdContext &ctx, snd_seq_query_subs_type_t type)
+{
+    acdSequencer *seq = ctx.Sequencer();
+    size_t count = 0;
+    snd_seq_addr_t sub_addr;
+
+    for (int index = 0;
+        seq->QuerySubscribers(addr, type, index, sub_addr) >= 0; index++) {
+
+        // Our own announce subscription is not a patch.
+        if (sub_addr.client == ctx.config.my_id) continue;
+
+        subscribers.insert(acdSubAddr(sub_addr.client, sub_addr.port));
+        ctx.SenderAdd(addr, acdSubAddr(sub_addr.client, sub_addr.port));
+
+        if (ctx.config.verbose) {
+            fprintf(stdout, "Inserted subscription: %d:%d %s %d:%d: %d\n",
+                client.id, id,
+                (type == SND_SEQ_QUERY_SUBS_READ) ? "->" : "<-",
+                sub_addr.client, sub_addr.port, type
+            );
+        }
+
+        count++;
+    }
+
+    return count;
+}
+
+void acdAddressIndex::Insert(const acdClient &client)
+{
+    for (auto &it : client.ports) Insert(client, it.second);
+}
+
+void acdAddressIndex::Insert(const acdClient &client, const acdPort &port)
+{
+    index[acdEndpointKey(client.name_id, port.name_id)].insert(
+        acdSubAddr(client.id, port.id)
+    );
+}
+
+void acdAddressIndex::Erase(const acdClient &client)
+{
+    for (auto &it : client.ports) Erase(client, it.second);
+}
+
+void acdAddressIndex::Erase(const acdClient &client, const acdPort &port)
+{
+    auto it = index.find(acdEndpointKey(client.name_id, port.name_id));
+    if (it == index.end()) return;
+
+    it->second.erase(acdSubAddr(client.id, port.id));
+    if (it->second.empty()) index.erase(it);
+}
+
+bool acdAddressIndex::Lookup(const acdEndpointKey &key, snd_seq_addr_t &addr) const
+{
+    auto it = index.find(key);
+    if (it == index.end()) return false;
+
+    addr.client = it->second.begin()->first;
+    addr.port = it->second.begin()->second;
+
+    return true;
+}
+
+void acdContext::TopologyPurge(int client_id, int port_id)
+{
+    auto first = senders.lower_bound(
+        acdSubAddr(client_id, (port_id == -1) ? 0 : port_id));
+    auto last = (port_id == -1) ?
+        senders.lower_bound(acdSubAddr(client_id + 1, 0)) :
+        senders.upper_bound(acdSubAddr(client_id, port_id));
+
+    for (auto it = first; it != last; it++) {
+        for (auto &src : it->second) {
+            auto it_client = clients.find(src.first);
+            if (it_client == clients.end()) continue;
+
+            auto it_port = it_client->second.ports.find(src.second);
+            if (it_port == it_client->second.ports.end()) continue;
+
+            it_port->second.subscribers.erase(it->first);
+        }
+    }
+
+    senders.erase(first, last);
+}
+
+bool acdContext::TopologyClientExit(int client_id)
+{
+    auto it = clients.find(client_id);
+    if (it == clients.end()) return false;
+
+    vector<acdEndpointKey> keys;
+    for (auto &it_port : it->second.ports)
+        keys.push_back(acdEndpointKey(it->second.name_id, it_port.second.name_id));
+
+    address_index.Erase(it->second);
+    clients.erase(it);
+    instances.Release(client_id);
+
+    for (auto &key : keys) EndpointGone(key);
+
+    if (config.verbose)
+        fprintf(stdout, "Removed client: %d\n", client_id);
+
+    TopologyPurge(client_id);
+
+    return true;
+}
+
+bool acdContext::TopologyClient(int client_id)
+{
+    acdSeqClientInfo info;
+
+    if (seq->GetClientInfo(client_id, info) < 0)
+        return TopologyClientExit(client_id);
+
+    acdClient client(names, info);
+    client.name_id = instances.Assign(names, client.id, client.name_id);
+
+    vector<acdEndpointKey> keys;
+
+    auto it = clients.find(client.id);
+    bool changed = (it != clients.end());
+
+    if (! changed) {
+        it = clients.insert(make_pair(client.id, client)).first;
+
+        if (config.verbose) {
+            fprintf(stdout, "Inserted client: %d: %s\n",
+                client.id, client.name.c_str()
+            );
+        }
+    }
+    else {
+        for (auto &it_port : it->second.ports)
+            keys.push_back(acdEndpointKey(it->second.name_id, it_port.second.name_id));
+
+        address_index.Erase(it->second);
+
+        it->second.name = client.name;
+        it->second.name_id = client.name_id;
+        it->second.type = client.type;
+        it->second.card = client.card;
+        it->second.pid = client.pid;
+    }
+
+    it->second.RefreshPorts(*this);
+    address_index.Insert(it->second);
+
+    EndpointAppear(it->second, acd_time_us(), changed);
+    for (auto &key : keys) EndpointGone(key);
+
+    backoff.Reset(it->second.name_id);
+
+    return true;
+}
+
+bool acdContext::TopologyPortExit(int client_id, int port_id)
+{
+    auto it = clients.find(client_id);
+    if (it == clients.end()) return false;
+
+    auto it_port = it->second.ports.find(port_id);
+    if (it_port == it->second.ports.end()) return false;
+
+    acdEndpointKey key(it->second.name_id, it_port->second.name_id);
+
+    address_index.Erase(it->second, it_port->second);
+    it->second.ports.erase(it_port);
+
+    EndpointGone(key);
+
+    if (config.verbose)
+        fprintf(stdout, "Removed port: %d:%d\n", client_id, port_id);
+
+    TopologyPurge(client_id, port_id);
+
+    return true;
+}
+
+bool acdContext::TopologyPort(int client_id, int port_id)
+{
+    auto it = clients.find(client_id);
+
+    if (it == clients.end())
+        return TopologyClient(client_id);
+
+    acdEndpointKey key(acdNameTable::invalid, acdNameTable::invalid);
+
+    auto it_port = it->second.ports.find(port_id);
+    if (it_port != it->second.ports.end()) {
+        key = acdEndpointKey(it->second.name_id, it_port->second.name_id);
+        address_index.Erase(it->second, it_port->second);
+    }
+
+    bool changed = it->second.RefreshPort(*this, port_id);
+
+    it_port = it->second.ports.find(port_id);
+    if (it_port != it->second.ports.end()) {
+        address_index.Insert(it->second, it_port->second);
+        backoff.Reset(it->second.name_id, it_port->second.name_id);
+
+        acdEndpointKey current(it->second.name_id, it_port->second.name_id);
+        EndpointAppear(it_port->second, acd_time_us(), (key == current));
+    }
+    else
+        TopologyPurge(client_id, port_id);
+
+    if (key.first != acdNameTable::invalid) EndpointGone(key);
+
+    return changed;
+}
+
+const acdPort *acdContext::TopologyFind(const snd_seq_addr_t &addr) const
+{
+    auto it_client = clients.find(addr.client);
+    if (it_client == clients.end()) return NULL;
+
+    auto it_port = it_client->second.ports.find(addr.port);
+    if (it_port == it_client->second.ports.end()) return NULL;
+
+    return &it_port->second;
+}
+
+bool acdContext::TopologySubscribable(
+    const snd_seq_addr_t &src, const snd_seq_addr_t &dst) const
+{
+    const unsigned src_caps = SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ;
+    const unsigned dst_caps = SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE;
+
+    const acdPort *src_port = TopologyFind(src);
+    const acdPort *dst_port = TopologyFind(dst);
+
+    if (src_port != NULL && (src_port->capability & src_caps) != src_caps)
+        return false;
+    if (dst_port != NULL && (dst_port->capability & dst_caps) != dst_caps)
+        return false;
+
+    return true;
+}
+
+bool acdContext::TopologySubscription(const snd_seq_addr_t &src,
+    const snd_seq_addr_t &dst, bool subscribed, bool own)
+{
+    auto it_client = clients.find(src.client);
+    if (it_client == clients.end()) return false;
+
+    auto it_port = it_client->second.ports.find(src.port);
+    if (it_port == it_client->second.ports.end()) return false;
+
+    if (! config.IsVerified(acdEndpointKey(
+        it_client->second.name_id, it_port->second.name_id))) return false;
+
+    auto &subscribers = it_port->second.subscribers;
+
+    bool changed = (subscribed) ?
+        subscribers.insert(acdSubAddr(dst.client, dst.port)).second :
+        (subscribers.erase(acdSubAddr(dst.client, dst.port)) > 0);
+
+    if (subscribed)
+        SenderAdd(src, acdSubAddr(dst.client, dst.port));
+    else
+        SenderRemove(src, acdSubAddr(dst.client, dst.port));
+
+    // Our own subscriptions can't have resolved anything.
+    if (changed && (! subscribed || ! own)) {
+        // Exclusive conflicts may have been resolved.
+        backoff.Reset(
+            it_client->second.name_id, it_port->second.name_id, &touched);
+
+        const acdPort *dst_port = TopologyFind(dst);
+        if (dst_port != NULL) {
+            backoff.Reset(dst_port->client.name_id, dst_port->name_id, &touched);
+
+            acdPatchKey key(
+                acdEndpointKey(it_client->second.name_id, it_port->second.name_id),
+                acdEndpointKey(dst_port->client.name_id, dst_port->name_id)
+            );
+
+            touched.insert(key);
+
+            // Removed by someone else, it's no longer ours.
+            if (! subscribed) ledger.Erase(key);
+        }
+    }
+
+    return changed;
+}
+
+bool acdSubscription::GetAddress(const acdAddressIndex &index,
+    const acdPatch &patch, snd_seq_addr_t &addr, enum AddrType atype)
+{
+    return index.Lookup(
+        (atype == atSRC) ? patch.key.first : patch.key.second, addr
+    );
+}
+
+void acdSubscription::GetAddress(
+    const acdSubscription &subscription, snd_seq_addr_t &addr, enum AddrType atype)
+{
+    switch (atype) {
+    case atSRC:
+        addr = subscription.src_port.addr;
+        break;
+
+    case atDST:
+    default:
+        addr = subscription.dst_port.addr;
+        break;
+    }
+}
+
+bool acdSubscription::Add(acdContext &ctx, const acdPlanOp &op)
+{
+    if (acdSubscription::Execute(ctx.Sequencer(), op.patch, op.src, op.dst, etSUBSCRIBE)) {
+        ctx.TopologySubscription(op.src, op.dst, true, true);
+        ctx.ledger.Insert(op.key);
+        ctx.latency.Record(op.key, acd_time_us());
+        ctx.metrics.Count(ctx.metrics.subscribed);
+
+        fprintf(stdout, "Subscribed: %s/%s -> %s/%s\n",
+            ctx.names.Name(op.key.first.first).c_str(),
+            ctx.names.Name(op.key.first.second).c_str(),
+            ctx.names.Name(op.key.second.first).c_str(),
+            ctx.names.Name(op.key.second.second).c_str()
+        );
+        return true;
+    }
+
+    return false;
+}
+
+bool acdSubscription::Remove(acdContext &ctx, const acdPlanOp &op)
+{
+    if (acdSubscription::Execute(ctx.Sequencer(), NULL, op.src, op.dst, etUNSUBSCRIBE)) {
+        ctx.TopologySubscription(op.src, op.dst, false, true);
+        ctx.ledger.Erase(op.key);
+        ctx.metrics.Count(ctx.metrics.unsubscribed);
+
+        fprintf(stdout, "Unsubscribed: %s/%s -> %s/%s\n",
+            ctx.names.Name(op.key.first.first).c_str(),
+            ctx.names.Name(op.key.first.second).c_str(),
+            ctx.names.Name(op.key.second.first).c_str(),
+            ctx.names.Name(op.key.second.second).c_str()
+        );
+        return true;
+    }
+
+    return false;
+}
+
+bool acdSubscription::Execute(acdSequencer *seq, const acdPatch *patch,
+    const snd_seq_addr_t &src, const snd_seq_addr_t &dst, enum ExecType etype)
+{
+    int rc;
+
+    switch (etype) {
+    case etSUBSCRIBE:
+        if (patch != NULL) {
+            rc = seq->Subscribe(src, dst, patch->queue, patch->exclusive,
+                patch->convert_time, patch->convert_real);
+        }
+        else
+            rc = seq->Subscribe(src, dst, 0, false, 0, 0);
+
+        if (rc < 0) {
+            fprintf(stderr, "Failed to subscribe: %s\n", snd_strerror(rc));
+            errno = -rc;
+            return false;
+        }
+
+        break;
+
+    case etUNSUBSCRIBE:
+    default:
+        if ((rc = seq->Unsubscribe(src, dst)) < 0) {
+            fprintf(stderr, "Failed to unsubscribe: %s\n", snd_strerror(rc));
+            errno = -rc;
+            return false;
+        }
+        break;
+    }
+
+    return true;
+}
+
+acdEventLoop::~acdEventLoop()
+{
+    if (fd_epoll != -1) close(fd_epoll);
+}
+
+bool acdEventLoop::Create(void)
+{
+    if ((fd_epoll = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        fprintf(stderr, "epoll_create1: %s\n", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+bool acdEventLoop::Add(int fd, uint32_t events, Handler handler)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(struct epoll_event));
+
+    ev.events = events;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        fprintf(stderr, "epoll_ctl: %d: %s\n", fd, strerror(errno));
+        return false;
+    }
+
+    handlers[fd] = handler;
+
+    return true;
+}
+
+bool acdEventLoop::Modify(int fd, uint32_t events)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(struct epoll_event));
+
+    ev.events = events;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(fd_epoll, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        fprintf(stderr, "epoll_ctl: %d: %s\n", fd, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+bool acdEventLoop::Remove(int fd)
+{
+    if (handlers.erase(fd) == 0) return false;
+
+    if (epoll_ctl(fd_epoll, EPOLL_CTL_DEL, fd, NULL) < 0) {
+        fprintf(stderr, "epoll_ctl: %d: %s\n", fd, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+int acdEventLoop::Dispatch(int timeout)
+{
+    struct epoll_event events[16];
+
+    if (busy_since != 0) {
+        uint64_t lag = acd_time_us() - busy_since;
+
+        lag_us.store(lag, memory_order_relaxed);
+        if (lag > lag_max_us.load(memory_order_relaxed))
+            lag_max_us.store(lag, memory_order_relaxed);
+    }
+
+    int rc = epoll_wait(fd_epoll, events, 16, timeout);
+
+    busy_since = acd_time_us();
+
+    if (rc < 0) {
+        if (errno == EINTR) return 0;
+        fprintf(stderr, "epoll_wait: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < rc; i++) {
+        auto it = handlers.find(events[i].data.fd);
+        if (it == handlers.end()) continue;
+        // Copy, the handler may remove itself.
+        Handler handler = it->second;
+        handler(events[i].events);
+    }
+
+    return rc;
+}
+
+bool acdBackoff::IsPending(const acdPatchKey &key, uint64_t now) const
+{
+    auto it = entries.find(key);
+    if (it == entries.end()) return false;
+
+    return (now < it->second.retry_at);
+}
+
+unsigned acdBackoff::Failure(const acdPatchKey &key, int error, uint64_t now)
+{
+    Entry &entry = entries[key];
+
+    entry.error = error;
+    if (entry.failures < 32) entry.failures++;
+
+    uint64_t delay = (uint64_t)delay_min << (entry.failures - 1);
+    if (delay > delay_max) delay = delay_max;
+
+    // +/- 25% jitter, so patches failing together don't retry together.
+    delay = delay * 3 / 4 + rand_r(&seed) % (delay / 2 + 1);
+
+    entry.retry_at = now + delay;
+
+    return (unsigned)delay;
+}
+
+void acdBackoff::Reject(const acdPatchKey &key, int error)
+{
+    Entry &entry = entries[key];
+
+    entry.error = error;
+    entry.failures++;
+    entry.retry_at = never;
+}
+
+size_t acdBackoff::Reset(acdNameId client, acdNameId port,
+    set<acdPatchKey> *keys)
+{
+    size_t count = 0;
+
+    for (auto it = entries.begin(); it != entries.end(); ) {
+        const acdPatchKey &key = it->first;
+
+        if ((key.first.first == client &&
+            (port == acdNameTable::invalid || key.first.second == port)) ||
+            (key.second.first == client &&
+            (port == acdNameTable::invalid || key.second.second == port))) {
+            if (keys != NULL) keys->insert(key);
+            it = entries.erase(it);
+            count++;
+        }
+        else
+            it++;
+    }
+
+    return count;
+}
+
+bool acdBackoff::NextRetry(uint64_t &when) const
+{
+    bool pending = false;
+
+    for (auto &it : entries) {
+        if (it.second.retry_at == never) continue;
+        if (! pending || it.second.retry_at < when) when = it.second.retry_at;
+        pending = true;
+    }
+
+    return pending;
+}
+
+void acdLedger::Insert(const acdPatchKey &key)
+{
+    if (owned.insert(key).second) dirty = true;
+}
+
+void acdLedger::Erase(const acdPatchKey &key)
+{
+    if (owned.erase(key) > 0) dirty = true;
+}
+
+void acdLedger::Prune(const map<acdPatchKey, acdPatch> &patches)
+{
+    for (auto it = owned.begin(); it != owned.end(); ) {
+        if (patches.find(*it) == patches.end()) {
+            it = owned.erase(it);
+            dirty = true;
+        }
+        else
+            it++;
+    }
+}
+
+bool acdLedger::Load(const string &filename, acdNameTable &names)
+{
+    json j;
+    ifstream ifs(filename);
+
+    // Nothing owned yet.
+    if (! ifs.is_open()) return true;
+
+    try {
+        ifs >> j;
+
+        set<acdPatchKey> next;
+
+        for (auto &it : j.at("owned")) {
+            next.insert(acdPatchKey(
+                acdEndpointKey(
+                    names.Intern(it.at("src_client").get<string>()),
+                    names.Intern(it.at("src_port").get<string>())),
+                acdEndpointKey(
+                    names.Intern(it.at("dst_client").get<string>()),
+                    names.Intern(it.at("dst_port").get<string>()))
+            ));
+        }
+
+        owned.swap(next);
+    }
+    catch (exception &e) {
+        fprintf(stderr, "Error loading ledger: %s\n", filename.c_str());
+        return false;
+    }
+
+    dirty = false;
+
+    return true;
+}
+
+bool acdLedger::Save(const string &filename, const acdNameTable &names)
+{
+    json j;
+    j["owned"] = json::array();
+
+    for (auto &key : owned) {
+        j["owned"].push_back({
+            { "src_client", names.Name(key.first.first) },
+            { "src_port", names.Name(key.first.second) },
+            { "dst_client", names.Name(key.second.first) },
+            { "dst_port", names.Name(key.second.second) }
+        });
+    }
+
+    string temp = filename + ".tmp";
+    ofstream ofs(temp, ios::trunc);
+
+    if (ofs.is_open()) ofs << j.dump() << endl;
+    ofs.close();
+
+    if (ofs.fail() || rename(temp.c_str(), filename.c_str()) < 0) {
+        int error = errno;
+
+        fprintf(stderr, "Error saving ledger: %s: %s\n",
+            filename.c_str(), strerror(error));
+        unlink(temp.c_str());
+
+        // For the caller.
+        errno = error;
+        return false;
+    }
+
+    dirty = false;
+
+    return true;
+}
+
+void acdReconciler::Plan(
+    const map<acdPatchKey, acdPatch> &patches,
+    const acdSubMap &subscriptions,
+    const acdAddressIndex &index, acdPlan &plan, const Filter &managed)
+{
+    plan.clear();
+
+    auto it_patch = patches.begin();
+    auto it_sub = subscriptions.begin();
+
+    while (it_patch != patches.end() || it_sub != subscriptions.end()) {
+        if (it_sub == subscriptions.end() ||
+            (it_patch != patches.end() && it_patch->first < it_sub->first)) {
+            snd_seq_addr_t src, dst;
+
+            if (acdSubscription::GetAddress(
+                    index, it_patch->second, src, acdSubscription::atSRC) &&
+                acdSubscription::GetAddress(
+                    index, it_patch->second, dst, acdSubscription::atDST)) {
+                plan.push_back(acdPlanOp(acdPlanOp::opSUBSCRIBE,
+                    it_patch->first, src, dst, &it_patch->second
+                ));
+            }
+
+            it_patch++;
+        }
+        else if (it_patch == patches.end() || it_sub->first < it_patch->first) {
+            snd_seq_addr_t src, dst;
+
+            if (managed && ! managed(it_sub->first)) {
+                it_sub++;
+                continue;
+            }
+
+            acdSubscription::GetAddress(
+                it_sub->second, src, acdSubscription::atSRC);
+            acdSubscription::GetAddress(
+                it_sub->second, dst, acdSubscription::atDST);
+
+            plan.push_back(acdPlanOp(acdPlanOp::opUNSUBSCRIBE,
+                it_sub->first, src, dst
+            ));
+
+            it_sub++;
+        }
+        else {
+            it_patch++;
+            it_sub++;
+        }
+    }
+
+    stable_partition(plan.begin(), plan.end(),
+        [](const acdPlanOp &op) { return op.type == acdPlanOp::opUNSUBSCRIBE; }
+    );
+}
+
+size_t acdReconciler::Apply(acdContext &ctx, const acdPlan &plan, uint64_t now)
+{
+    acdBackoff &backoff = ctx.backoff;
+    size_t count = 0;
+    enum acdStats::Phase phase = acdStats::phCOUNT;
+
+    for (auto &op : plan) {
+        // Unsubscribes come first, see Plan().
+        enum acdStats::Phase op_phase = (op.type == acdPlanOp::opSUBSCRIBE) ?
+            acdStats::phADD : acdStats::phREMOVE;
+
+        if (op_phase != phase) {
+            if (phase != acdStats::phCOUNT) ctx.stats.End();
+            ctx.stats.Begin(phase = op_phase);
+        }
+
+        switch (op.type) {
+        case acdPlanOp::opSUBSCRIBE:
+            if (backoff.IsPending(op.key, now)) break;
+
+            if (! ctx.TopologySubscribable(op.src, op.dst)) {
+                fprintf(stderr, "Unable to subscribe: %s/%s -> %s/%s: %s\n",
+                    ctx.names.Name(op.key.first.first).c_str(),
+                    ctx.names.Name(op.key.first.second).c_str(),
+                    ctx.names.Name(op.key.second.first).c_str(),
+                    ctx.names.Name(op.key.second.second).c_str(),
+                    "port capabilities"
+                );
+                backoff.Reject(op.key, EPERM);
+                ctx.metrics.Count(ctx.metrics.failed);
+                break;
+            }
+
+            if (acdSubscription::Add(ctx, op)) {
+                backoff.Success(op.key);
+                count++;
+            }
+            else {
+                unsigned delay = backoff.Failure(op.key, errno, now);
+                ctx.metrics.Count(ctx.metrics.failed);
+
+                fprintf(stderr, "Retrying in %u ms: %s/%s -> %s/%s\n", delay,
+                    ctx.names.Name(op.key.first.first).c_str(),
+                    ctx.names.Name(op.key.first.second).c_str(),
+                    ctx.names.Name(op.key.second.first).c_str(),
+                    ctx.names.Name(op.key.second.second).c_str()
+                );
+            }
+            break;
+
+        case acdPlanOp::opUNSUBSCRIBE:
+        default:
+            if (acdSubscription::Remove(ctx, op)) count++;
+            break;
+        }
+    }
+
+    if (phase != acdStats::phCOUNT) ctx.stats.End();
+
+    return count;
+}
+
+void acdReconciler::Print(FILE *fh,
+    const acdNameTable &names, const acdPlan &plan)
+{
+    for (auto &op : plan) {
+        fprintf(fh, "%s: %s/%s -> %s/%s (%d:%d -> %d:%d)\n",
+            (op.type == acdPlanOp::opSUBSCRIBE) ? "Subscribe" : "Unsubscribe",
+            names.Name(op.key.first.first).c_str(),
+            names.Name(op.key.first.second).c_str(),
+            names.Name(op.key.second.first).c_str(),
+            names.Name(op.key.second.second).c_str(),
+            op.src.client, op.src.port, op.dst.client, op.dst.port
+        );
+    }
+}
+
+void acdContext::Refresh(void)
+{
+    uint64_t now = acd_time_us();
+
+    stats.Begin(acdStats::phREFRESH);
+
+    clients.clear();
+    senders.clear();
+    address_index.Clear();
+    touched_all = true;
+
+    vector<acdSeqClientInfo> infos;
+    acdSeqClientInfo info;
+
+    while (seq->QueryNextClient(info) >= 0) {
+        if (info.client != config.my_id) infos.push_back(info);
+    }
+
+    // Clients still present keep their instance.
+    instances.Retain(names, infos);
+
+    for (auto &it_info : infos) {
+        acdClient client(names, it_info);
+        client.name_id = instances.Assign(names, client.id, client.name_id);
+
+        auto it = clients.insert(make_pair(client.id, client));
+
+        if (it.second == true) {
+            if (config.verbose) {
+                fprintf(stdout, "Inserted client: %d: %s\n",
+                    client.id, client.name.c_str()
+                );
+            }
+
+            it.first->second.RefreshPorts(*this);
+            address_index.Insert(it.first->second);
+
+            EndpointAppear(it.first->second, now);
+        }
+    }
+
+    // Endpoints still present keep the time they first appeared.
+    latency.Retain(address_index);
+
+    if (config.HasRules()) {
+        vector<acdPatchKey> removed;
+        auto present = [this](const acdEndpointKey &key) {
+            return EndpointPresent(key);
+        };
+
+        config.rules.Retain(present, removed);
+        for (auto &matrix : config.matrices) matrix.Retain(present, removed);
+
+        for (auto &key : removed) RuleRemove(key);
+    }
+
+    stats.End();
+}
+
+void acdContext::RefreshSubscriptions(void)
+{
+    for (auto &it_client : clients) {
+        for (auto &it_port : it_client.second.ports)
+            it_port.second.RefreshSubscriptions(*this);
+    }
+}
+
+uint64_t acd_time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t acd_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool acdContext::ProcessEvents(void)
+{
+    int rc;
+    bool changed = false;
+    acdSeqEvent event;
+
+    stats.Begin(acdStats::phEVENTS);
+
+    while ((rc = seq->EventInput(event)) != -EAGAIN) {
+        if (rc == -ENOSPC) {
+            // Input overrun, events were lost; only a full refresh is safe.
+            fprintf(stderr, "Announce event queue overrun.\n");
+            Refresh();
+            backoff.Clear();
+            changed = true;
+            continue;
+        }
+        else if (rc < 0) {
+            fprintf(stderr, "Error reading announce event: %s\n",
+                snd_strerror(rc));
+            break;
+        }
+
+        changed |= ProcessEvent(event);
+    }
+
+    stats.End();
+
+    return changed;
+}
+
+bool acdContext::ProcessEvent(const acdSeqEvent &event)
+{
+    switch (event.type) {
+    case SND_SEQ_EVENT_CLIENT_START:
+    case SND_SEQ_EVENT_CLIENT_EXIT:
+    case SND_SEQ_EVENT_CLIENT_CHANGE:
+    case SND_SEQ_EVENT_PORT_START:
+    case SND_SEQ_EVENT_PORT_EXIT:
+    case SND_SEQ_EVENT_PORT_CHANGE:
+        if (event.addr.client == config.my_id) return false;
+
+        if (config.verbose) {
+            fprintf(stdout, "Announce event: %d: %d:%d\n",
+                event.type, event.addr.client, event.addr.port
+            );
+        }
+        break;
+
+    case SND_SEQ_EVENT_PORT_SUBSCRIBED:
+    case SND_SEQ_EVENT_PORT_UNSUBSCRIBED:
+        if (event.sender.client == config.my_id ||
+            event.dest.client == config.my_id) return false;
+
+        if (config.verbose) {
+            fprintf(stdout, "Announce event: %d: %d:%d -> %d:%d\n",
+                event.type,
+                event.sender.client, event.sender.port,
+                event.dest.client, event.dest.port
+            );
+        }
+        break;
+
+    default:
+        return false;
+    }
+
+    bool changed = false;
+
+    switch (event.type) {
+    case SND_SEQ_EVENT_CLIENT_START:
+    case SND_SEQ_EVENT_CLIENT_CHANGE:
+        changed = TopologyClient(event.addr.client);
+        break;
+
+    case SND_SEQ_EVENT_CLIENT_EXIT:
+        changed = TopologyClientExit(event.addr.client);
+        break;
+
+    case SND_SEQ_EVENT_PORT_START:
+    case SND_SEQ_EVENT_PORT_CHANGE:
+        changed = TopologyPort(event.addr.client, event.addr.port);
+        break;
+
+    case SND_SEQ_EVENT_PORT_EXIT:
+        changed = TopologyPortExit(event.addr.client, event.addr.port);
+        break;
+
+    case SND_SEQ_EVENT_PORT_SUBSCRIBED:
+    case SND_SEQ_EVENT_PORT_UNSUBSCRIBED:
+        changed = TopologySubscription(
+            event.sender, event.dest,
+            event.type == SND_SEQ_EVENT_PORT_SUBSCRIBED);
+        break;
+    }
+
+    return changed;
+}
+
+void acdContext::ResolveSubscriptions(void)
+{
+    stats.Begin(acdStats::phRESOLVE);
+
+    sub_map.clear();
+
+    for (auto &it_src_client : clients) {
+        for (auto &it_src_port : it_src_client.second.ports) {
+            for (auto &it_sub : it_src_port.second.subscribers) {
+
+                auto it_dst_client = clients.find(it_sub.first);
+
+                if (it_dst_client == clients.end()) {
+                    fprintf(stderr, "Subscription from invalid destination client: %d\n",
+                        it_sub.first
+                    );
+                    continue;
+                }
+
+                auto it_dst_port = it_dst_client->second.ports.find(it_sub.second);
+
+                if (it_dst_port == it_dst_client->second.ports.end()) {
+                    fprintf(stderr, "Subscription from invalid destination address: %d:%d\n",
+                        it_sub.first, it_sub.second
+                    );
+                    continue;
+                }
+
+                acdSubscription subscription(
+                    it_src_client.second, it_src_port.second,
+                    it_dst_client->second, it_dst_port->second,
+                    SND_SEQ_QUERY_SUBS_READ
+                );
+
+                auto it = sub_map.insert(
+                    make_pair(subscription.MakeKey(), subscription)
+                );
+
+                if (it.second == true && config.verbose) {
+                    fprintf(stdout, "Resolved subscription: %s/%s -> %s/%s\n",
+                        it_src_client.second.name.c_str(),
+                        it_src_port.second.name.c_str(),
+                        it_dst_client->second.name.c_str(),
+                        it_dst_port->second.name.c_str()
+                    );
+                }
+            }
+        }
+    }
+
+    stats.End();
+}
+
+void acdContext::StatusDump(FILE *fh) const
+{
+    size_t ports = 0, subscriptions = 0;
+
+    for (auto &it_client : clients) {
+        ports += it_client.second.ports.size();
+        for (auto &it_port : it_client.second.ports)
+            subscriptions += it_port.second.subscribers.size();
+    }
+
+    fprintf(fh, "Status: clients: %zu, ports: %zu, subscriptions: %zu, patches: %zu, owned: %zu\n",
+        clients.size(), ports, subscriptions, config.patches.size(), ledger.Size()
+    );
+
+    uint64_t now = acd_time_ms();
+
+    for (auto &it : backoff.Entries()) {
+        const acdPatchKey &key = it.first;
+        const acdBackoff::Entry &entry = it.second;
+
+        fprintf(fh, "Backoff: %s/%s -> %s/%s: failures: %u: %s: ",
+            names.Name(key.first.first).c_str(),
+            names.Name(key.first.second).c_str(),
+            names.Name(key.second.first).c_str(),
+            names.Name(key.second.second).c_str(),
+            entry.failures, strerror(entry.error)
+        );
+
+        if (entry.retry_at == acdBackoff::never)
+            fprintf(fh, "retry on topology change\n");
+        else {
+            fprintf(fh, "retry in %lu ms\n", (unsigned long)(
+                (entry.retry_at > now) ? entry.retry_at - now : 0
+            ));
+        }
+    }
+
+    stats.Print(fh);
+    latency.Overall().Print(fh, "Latency");
+
+    for (auto &it : latency.Entries()) {
+        const acdPatchKey &key = it.first;
+        string prefix = "Latency: " +
+            names.Name(key.first.first) + "/" + names.Name(key.first.second) +
+            " -> " +
+            names.Name(key.second.first) + "/" + names.Name(key.second.second);
+
+        it.second.histogram.Print(fh, prefix.c_str());
+    }
+}
+
+void acdContext::Reconcile(const map<acdPatchKey, acdPatch> &patches)
+{
+    uint64_t start = acd_time_us();
+    acdPlan plan;
+
+    touched.clear();
+    touched_all = false;
+
+    ResolveSubscriptions();
+
+    stats.Begin(acdStats::phPLAN);
+    acdReconciler::Plan(patches, sub_map, address_index, plan,
+        [this](const acdPatchKey &key) { return IsManaged(key); }
+    );
+    stats.End();
+
+    if (config.dry_run)
+        acdReconciler::Print(stdout, names, plan);
+    else {
+        acdReconciler::Apply(*this, plan, acd_time_ms());
+        ledger.Prune(patches);
+        latency.Prune(patches);
+    }
+
+    SourceFlush();
+    LedgerSave();
+
+    metrics.Reconciled(acd_time_us() - start);
+    status_page.Publish(*this);
+}
+
+void acdContext::Reconcile(void)
+{
+    Reconcile(config.patches);
+}
+
+void acdContext::Reconcile(const set<acdPatchKey> &keys)
+{
+    uint64_t start = acd_time_us();
+    acdPlan plan;
+
+    stats.Begin(acdStats::phPLAN);
+
+    for (auto &key : keys) {
+        snd_seq_addr_t src, dst;
+
+        if (! address_index.Lookup(key.first, src) ||
+            ! address_index.Lookup(key.second, dst)) continue;
+
+        const acdPort *src_port = TopologyFind(src);
+        bool subscribed = (src_port != NULL &&
+            src_port->subscribers.count(acdSubAddr(dst.client, dst.port)) > 0);
+
+        auto it = config.patches.find(key);
+
+        if (it != config.patches.end()) {
+            if (! subscribed) {
+                plan.push_back(acdPlanOp(
+                    acdPlanOp::opSUBSCRIBE, key, src, dst, &it->second
+                ));
+            }
+        }
+        else if (subscribed && IsManaged(key))
+            plan.push_back(acdPlanOp(acdPlanOp::opUNSUBSCRIBE, key, src, dst));
+    }
+
+    stable_partition(plan.begin(), plan.end(),
+        [](const acdPlanOp &op) { return op.type == acdPlanOp::opUNSUBSCRIBE; }
+    );
+
+    stats.End();
+
+    if (config.dry_run)
+        acdReconciler::Print(stdout, names, plan);
+    else
+        acdReconciler::Apply(*this, plan, acd_time_ms());
+
+    SourceFlush();
+    LedgerSave();
+
+    metrics.Reconciled(acd_time_us() - start);
+    status_page.Publish(*this, keys);
+}
+
+void acdContext::ReconcileTouched(void)
+{
+    if (touched_all) {
+        Reconcile();
+        return;
+    }
+
+    set<acdPatchKey> keys;
+    keys.swap(touched);
+
+    Reconcile(keys);
+}
+
+bool acdContext::IsManaged(const acdPatchKey &key) const
+{
+    if (ledger.Owns(key)) return true;
+
+    switch (config.policy) {
+    case acdConfig::poOWNED:
+        return false;
+
+    case acdConfig::poSCOPED:
+        return (config.scope.find(key.first.first) != config.scope.end() ||
+            config.scope.find(key.second.first) != config.scope.end());
+
+    case acdConfig::poTAKEOVER:
+    default:
+        return true;
+    }
+}
+
+void acdContext::LedgerSave(void)
+{
+    if (ledger_file.empty() || ! ledger.IsDirty()) return;
+
+    if (ledger.Save(ledger_file, names)) return;
+
+    // Run outside of its service, the directory may be missing or not
+    // writable: retrying on every reconcile would only flood the log.
+    if (errno == ENOENT || errno == EACCES || errno == EROFS) {
+        fprintf(stderr, "Ownership ledger not persisted.\n");
+        ledger_file.clear();
+    }
+}
+
+bool acdContext::SnapshotSave(const string &filename) const
+{
+    json j;
+    j["subscriptions"] = json::array();
+
+    for (auto &it : config.patches) {
+        snd_seq_addr_t src, dst;
+
+        if (! address_index.Lookup(it.first.first, src) ||
+            ! address_index.Lookup(it.first.second, dst)) continue;
+
+        const acdPort *src_port = TopologyFind(src);
+
+        if (src_port == NULL ||
+            src_port->subscribers.count(acdSubAddr(dst.client, dst.port)) == 0)
+            continue;
+
+        j["subscriptions"].push_back({
+            { "src_client", it.second.src_client },
+            { "src_port", it.second.src_port },
+            { "dst_client", it.second.dst_client },
+            { "dst_port", it.second.dst_port },
+            { "src", { src.client, src.port } },
+            { "dst", { dst.client, dst.port } }
+        });
+    }
+
+    string temp = filename + ".tmp";
+    ofstream ofs(temp, ios::trunc);
+
+    if (ofs.is_open()) ofs << j.dump() << endl;
+    ofs.close();
+
+    if (ofs.fail() || rename(temp.c_str(), filename.c_str()) < 0) {
+        fprintf(stderr, "Error saving snapshot: %s: %s\n",
+            filename.c_str(), strerror(errno));
+        unlink(temp.c_str());
+        return false;
+    }
+
+    fprintf(stdout, "Handing off %zu subscriptions.\n",
+        j["subscriptions"].size());
+
+    return true;
+}
+
+size_t acdContext::SnapshotAdopt(const string &filename)
+{
+    json j;
+    ifstream ifs(filename);
+    if (! ifs.is_open()) return 0;
+
+    size_t count = 0;
+
+    try {
+        ifs >> j;
+
+        for (auto &it : j.at("subscriptions")) {
+            acdPatchKey key(
+                acdEndpointKey(
+                    names.Intern(it.at("src_client").get<string>()),
+                    names.Intern(it.at("src_port").get<string>())),
+                acdEndpointKey(
+                    names.Intern(it.at("dst_client").get<string>()),
+                    names.Intern(it.at("dst_port").get<string>()))
+            );
+
+            snd_seq_addr_t src, dst;
+            src.client = it.at("src").at(0).get<int>();
+            src.port = it.at("src").at(1).get<int>();
+            dst.client = it.at("dst").at(0).get<int>();
+            dst.port = it.at("dst").at(1).get<int>();
+
+            // Still in place, between the same endpoints.
+            const acdPort *src_port = TopologyFind(src);
+            const acdPort *dst_port = TopologyFind(dst);
+
+            if (src_port == NULL || dst_port == NULL ||
+                src_port->client.name_id != key.first.first ||
+                src_port->name_id != key.first.second ||
+                dst_port->client.name_id != key.second.first ||
+                dst_port->name_id != key.second.second ||
+                src_port->subscribers.count(
+                    acdSubAddr(dst.client, dst.port)) == 0) continue;
+
+            ledger.Insert(key);
+            count++;
+        }
+    }
+    catch (exception &e) {
+        fprintf(stderr, "Error loading snapshot: %s\n", filename.c_str());
+    }
+
+    ifs.close();
+    unlink(filename.c_str());
+
+    fprintf(stdout, "Adopted %zu subscriptions.\n", count);
+
+    return count;
+}
+
+bool acdContext::Reload(const string &filename)
+{
+    acdConfig next;
+
+    if (! next.Load(filename, names)) {
+        fprintf(stderr, "Keeping the current configuration.\n");
+        return false;
+    }
+
+    RuleExpand(next);
+
+    // Changes to the set of verified ports or to the policy apply to all
+    // observed subscriptions.
+    bool verify = (config.targeted_verify != next.targeted_verify ||
+        config.policy != next.policy || config.scope != next.scope);
+
+    config.refresh_ttl = next.refresh_ttl;
+    config.handoff = next.handoff;
+    config.targeted_verify = next.targeted_verify;
+    config.policy = next.policy;
+    config.scope.swap(next.scope);
+
+    // Sorted-merge of the active and new patches.  Patches with new
+    // options are removed first, so they're subscribed again.
+    vector<const acdPatch *> added;
+    set<acdPatchKey> removed;
+
+    auto it_old = config.patches.begin();
+    auto it_new = next.patches.begin();
+
+    while (it_old != config.patches.end() || it_new != next.patches.end()) {
+        if (it_new == next.patches.end() ||
+            (it_old != config.patches.end() && it_old->first < it_new->first)) {
+            removed.insert(it_old->first);
+            it_old++;
+        }
+        else if (it_old == config.patches.end() ||
+            it_new->first < it_old->first) {
+            added.push_back(&it_new->second);
+            it_new++;
+        }
+        else {
+            if (! it_old->second.SameOptions(it_new->second)) {
+                removed.insert(it_old->first);
+                added.push_back(&it_new->second);
+            }
+            it_old++;
+            it_new++;
+        }
+    }
+
+    if (config.verbose) {
+        fprintf(stdout, "Reloaded: %zu patches added, %zu removed\n",
+            added.size(), removed.size());
+    }
+
+    for (auto &key : removed) RemovePatch(key);
+
+    config.disabled.swap(next.disabled);
+    config.rules.Swap(next.rules);
+    config.matrices.swap(next.matrices);
+    config.expanded.swap(next.expanded);
+
+    if (verify) {
+        for (auto patch : added) AddPatch(*patch);
+        RefreshSubscriptions();
+        Reconcile();
+        return true;
+    }
+
+    Reconcile(removed);
+
+    set<acdPatchKey> keys;
+
+    for (auto patch : added) {
+        AddPatch(*patch);
+        keys.insert(patch->key);
+    }
+
+    Reconcile(keys);
+
+    // Disabled patches were swapped in wholesale.
+    status_page.Publish(*this);
+
+    return true;
+}
+
+void acdContext::AddPatch(const acdPatch &patch)
+{
+    const acdPatchKey &key = patch.MakeKey();
+
+    config.disabled.erase(key);
+
+    auto it = config.patches.find(key);
+    if (it != config.patches.end())
+        config.patches.erase(it);
+    else {
+        SourceAdd(key.first);
+        config.DependentAdd(key);
+    }
+
+    config.patches.insert(make_pair(key, patch));
+
+    // New options, or a new chance.
+    backoff.Success(key);
+}
+
+bool acdContext::RemovePatch(const acdPatchKey &key)
+{
+    config.expanded.erase(key);
+
+    if (config.disabled.erase(key) > 0) return true;
+
+    if (config.patches.erase(key) == 0) return false;
+
+    SourceRemove(key.first);
+    config.DependentRemove(key);
+    backoff.Success(key);
+
+    return true;
+}
+
+bool acdContext::EnablePatch(const acdPatchKey &key)
+{
+    auto it = config.disabled.find(key);
+    if (it == config.disabled.end())
+        return (config.patches.find(key) != config.patches.end());
+
+    // AddPatch() drops the disabled copy.
+    acdPatch patch = it->second;
+    AddPatch(patch);
+
+    return true;
+}
+
+bool acdContext::DisablePatch(const acdPatchKey &key)
+{
+    auto it = config.patches.find(key);
+    if (it == config.patches.end())
+        return (config.disabled.find(key) != config.disabled.end());
+
+    config.disabled.insert(*it);
+    config.patches.erase(it);
+
+    SourceRemove(key.first);
+    config.DependentRemove(key);
+    backoff.Success(key);
+
+    return true;
+}
+
+void acdContext::SourceAdd(const acdEndpointKey &key)
+{
+    if (config.sources[key]++ == 0 && config.targeted_verify)
+        RefreshSubscriptions(key);
+}
+
+void acdContext::SourceRemove(const acdEndpointKey &key)
+{
+    auto it = config.sources.find(key);
+    if (it == config.sources.end() || --it->second > 0) return;
+
+    config.sources.erase(it);
+
+    // Subscriptions are kept until the next reconcile has removed them.
+    if (config.targeted_verify) sources_dropped.insert(key);
+}
+
+void acdContext::SourceFlush(void)
+{
+    for (auto &key : sources_dropped) {
+        if (! config.IsVerified(key)) RefreshSubscriptions(key);
+    }
+
+    sources_dropped.clear();
+}
+
+void acdContext::RefreshSubscriptions(const acdEndpointKey &key)
+{
+    for (auto &it_client : clients) {
+        if (it_client.second.name_id != key.first) continue;
+
+        for (auto &it_port : it_client.second.ports) {
+            if (it_port.second.name_id == key.second)
+                it_port.second.RefreshSubscriptions(*this);
+        }
+    }
+}
+
+void acdContext::EndpointAppear(const acdPort &port, uint64_t now, bool changed)
+{
+    Touch(port);
+
+    latency.Appear(acdEndpointKey(port.client.name_id, port.name_id), now);
+
+    if (! config.HasRules()) return;
+
+    vector<acdRuleIndex::Match> added;
+    vector<acdPatchKey> removed;
+
+    if (changed)
+        config.rules.Change(port, names, added, removed);
+    else
+        config.rules.Appear(port, names, added);
+
+    for (auto &matrix : config.matrices) {
+        matrix.Appear(acdEndpointKey(port.client.name_id, port.name_id), names,
+            [this](const acdEndpointKey &key) { return EndpointPresent(key); },
+            added);
+    }
+
+    for (auto &match : added) RuleAdd(match);
+    for (auto &patch_key : removed) RuleRemove(patch_key);
+}
+
+void acdContext::EndpointAppear(const acdClient &client, uint64_t now, bool changed)
+{
+    for (auto &it : client.ports)
+        EndpointAppear(it.second, now, changed);
+}
+
+// The name may still resolve to another client or port.
+void acdContext::EndpointGone(const acdEndpointKey &key)
+{
+    snd_seq_addr_t addr;
+
+    // Patches may now resolve to another client or port.
+    Touch(key);
+
+    if (address_index.Lookup(key, addr)) return;
+
+    latency.Gone(key);
+
+    if (! config.HasRules()) return;
+
+    vector<acdPatchKey> removed;
+    config.rules.Gone(key, names, removed);
+    for (auto &matrix : config.matrices) matrix.Gone(key, removed);
+
+    for (auto &patch_key : removed) RuleRemove(patch_key);
+}
+
+bool acdContext::EndpointPresent(const acdEndpointKey &key) const
+{
+    snd_seq_addr_t addr;
+
+    return address_index.Lookup(key, addr);
+}
+
+// Patches from the configuration, enabled or not, take precedence over
+// the ones rules and matrices add.
+void acdContext::RuleAdd(const acdRuleIndex::Match &match)
+{
+    const acdPatchKey &key = match.first;
+
+    auto it = config.expanded.find(key);
+    if (it != config.expanded.end()) {
+        it->second++;
+        return;
+    }
+
+    if (config.patches.find(key) != config.patches.end() ||
+        config.disabled.find(key) != config.disabled.end())
+        return;
+
+    const acdPatchOptions &options = *match.second;
+
+    AddPatch(acdPatch(names,
+        names.Name(key.first.first), names.Name(key.first.second),
+        names.Name(key.second.first), names.Name(key.second.second),
+        options.queue, options.convert_real, options.convert_time,
+        options.exclusive));
+
+    config.expanded[key] = 1;
+    touched.insert(key);
+
+    if (config.verbose) {
+        fprintf(stdout, "Expanded patch: %s/%s -> %s/%s\n",
+            names.Name(key.first.first).c_str(),
+            names.Name(key.first.second).c_str(),
+            names.Name(key.second.first).c_str(),
+            names.Name(key.second.second).c_str());
+    }
+}
+
+void acdContext::RuleRemove(const acdPatchKey &key)
+{
+    auto it = config.expanded.find(key);
+    if (it == config.expanded.end() || --it->second > 0) return;
+
+    RemovePatch(key);
+    touched.insert(key);
+}
+
+// Matches the rules and matrices of a configuration being loaded against
+// the present endpoints, adding their patches to it.
+void acdContext::RuleExpand(acdConfig &next)
+{
+    if (! next.HasRules()) return;
+
+    vector<acdRuleIndex::Match> added;
+    auto present = [this](const acdEndpointKey &key) {
+        return EndpointPresent(key);
+    };
+
+    for (auto &it_client : clients) {
+        for (auto &it_port : it_client.second.ports) {
+            next.rules.Appear(it_port.second, names, added);
+
+            for (auto &matrix : next.matrices) {
+                matrix.Appear(acdEndpointKey(it_client.second.name_id,
+                    it_port.second.name_id), names, present, added);
+            }
+        }
+    }
+
+    for (auto &match : added) {
+        const acdPatchKey &key = match.first;
+
+        auto it = next.expanded.find(key);
+        if (it != next.expanded.end()) {
+            it->second++;
+            continue;
+        }
+
+        if (next.patches.find(key) != next.patches.end() ||
+            next.disabled.find(key) != next.disabled.end())
+            continue;
+
+        const acdPatchOptions &options = *match.second;
+
+        next.patches.insert(make_pair(key, acdPatch(names,
+            names.Name(key.first.first), names.Name(key.first.second),
+            names.Name(key.second.first), names.Name(key.second.second),
+            options.queue, options.convert_real, options.convert_time,
+            options.exclusive)));
+        next.sources[key.first]++;
+        next.expanded[key] = 1;
+    }
+}
+
+void acdContext::Touch(const acdEndpointKey &key)
+{
+    auto it = config.dependents.find(key);
+    if (it == config.dependents.end()) return;
+
+    touched.insert(it->second.begin(), it->second.end());
+}
+
+// Unpatched subscriptions of the port are touched too, so that they are
+// removed as a full reconcile would.
+void acdContext::Touch(const acdPort &port)
+{
+    acdEndpointKey key(port.client.name_id, port.name_id);
+
+    Touch(key);
+
+    for (auto &it : port.subscribers) {
+        snd_seq_addr_t addr;
+        addr.client = (unsigned char)it.first;
+        addr.port = (unsigned char)it.second;
+
+        const acdPort *dst_port = TopologyFind(addr);
+
+        if (dst_port != NULL) {
+            touched.insert(acdPatchKey(key,
+                acdEndpointKey(dst_port->client.name_id, dst_port->name_id)));
+        }
+    }
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,296 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <new>
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <ctime>
+
+#include <getopt.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <alsa/asoundlib.h>
+
+using namespace std;
+
+#include "aconnectd.h"
+
+// The mock hands out user client ids 128..191.
+#define ACD_BENCH_MAX_CLIENTS   64
+#define ACD_BENCH_MIN_NS        100000000ULL
+
+static size_t acd_bench_allocs = 0;
+
+void *operator new(size_t size)
+{
+    acd_bench_allocs++;
+    void *p = malloc(size ? size : 1);
+    if (p == NULL) throw bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+class acdBenchResult
+{
+public:
+    uint64_t ns;
+    size_t allocs;
+    size_t ops;
+
+    acdBenchResult() : ns(0), allocs(0), ops(0) { }
+};
+
+static uint64_t acd_bench_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static long acd_bench_rss(void)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) < 0) return -1;
+    return usage.ru_maxrss;
+}
+
+// Repeats cycle until it has run for at least ACD_BENCH_MIN_NS; each
+// cycle performs ops operations.
+static acdBenchResult acd_bench_run(size_t ops, function<void(void)> cycle)
+{
+    acdBenchResult result;
+    size_t cycles = 0;
+
+    uint64_t start = acd_bench_ns();
+    size_t allocs = acd_bench_allocs;
+
+    do {
+        cycle();
+        cycles++;
+        result.ns = acd_bench_ns() - start;
+    } while (result.ns < ACD_BENCH_MIN_NS);
+
+    result.allocs = (acd_bench_allocs - allocs) / cycles;
+    result.ns /= cycles * max(ops, (size_t)1);
+    result.ops = cycles;
+
+    return result;
+}
+
+static void acd_bench_report(FILE *fh, const char *name,
+    size_t ports, size_t patches, const acdBenchResult &result)
+{
+    fprintf(fh, "%-10s %7zu %7zu %12lu %10zu %8zu %10ld\n",
+        name, ports, patches, (unsigned long)result.ns, result.allocs,
+        result.ops, acd_bench_rss()
+    );
+}
+
+// Spreads the ports over at most ACD_BENCH_MAX_CLIENTS duplex clients.
+static void acd_bench_topology(acdSequencerMock &seq, size_t ports)
+{
+    const unsigned caps =
+        SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ |
+        SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE;
+
+    size_t clients = min(ports, (size_t)ACD_BENCH_MAX_CLIENTS);
+    char name[64];
+
+    for (size_t c = 0; c < clients; c++) {
+        snprintf(name, sizeof(name), "Bench %zu", c);
+        int client = seq.CreateClient(name);
+
+        for (size_t p = c; p < ports; p += clients) {
+            snprintf(name, sizeof(name), "Port %zu", p / clients);
+            seq.CreatePort(client, name, caps);
+        }
+    }
+}
+
+// One patch in eight names a client that isn't present.
+static void acd_bench_patches(acdContext &ctx,
+    size_t ports, size_t patches, unsigned seed)
+{
+    size_t clients = min(ports, (size_t)ACD_BENCH_MAX_CLIENTS);
+    size_t attempts = patches * 4;
+    char name[4][64];
+
+    while (ctx.config.patches.size() < patches && attempts-- > 0) {
+        size_t src = rand_r(&seed) % ports;
+        size_t dst = rand_r(&seed) % ports;
+        bool absent = (rand_r(&seed) % 8) == 0;
+
+        if (src == dst) continue;
+
+        snprintf(name[0], sizeof(name[0]), "Bench %zu", src % clients);
+        snprintf(name[1], sizeof(name[1]), "Port %zu", src / clients);
+        snprintf(name[2], sizeof(name[2]),
+            absent ? "Absent %zu" : "Bench %zu", dst % clients);
+        snprintf(name[3], sizeof(name[3]), "Port %zu", dst / clients);
+
+        acdPatch patch(ctx.names,
+            name[0], name[1], name[2], name[3], 0, 0, 0, false);
+
+        ctx.config.patches.insert(make_pair(patch.MakeKey(), patch));
+    }
+}
+
+static void acd_bench_scenario(FILE *fh, size_t ports, size_t patches)
+{
+    acdSequencerMock seq;
+    acdContext ctx(&seq);
+
+    acd_bench_topology(seq, ports);
+    acd_bench_patches(ctx, ports, patches, 1);
+
+    patches = ctx.config.patches.size();
+
+    acd_bench_report(fh, "refresh", ports, patches,
+        acd_bench_run(1, [&]() { ctx.Refresh(); })
+    );
+
+    acd_bench_report(fh, "resolve", ports, patches,
+        acd_bench_run(1, [&]() { ctx.ResolveSubscriptions(); })
+    );
+
+    acdPlan plan;
+
+    acd_bench_report(fh, "plan", ports, patches,
+        acd_bench_run(1, [&]() {
+            plan.clear();
+            acdReconciler::Plan(ctx.config.patches,
+                ctx.sub_map, ctx.address_index, plan);
+        })
+    );
+
+    acd_bench_report(fh, "address", ports, patches,
+        acd_bench_run(patches * 2, [&]() {
+            snd_seq_addr_t addr;
+            for (auto &it : ctx.config.patches) {
+                acdSubscription::GetAddress(ctx.address_index,
+                    it.second, addr, acdSubscription::atSRC);
+                acdSubscription::GetAddress(ctx.address_index,
+                    it.second, addr, acdSubscription::atDST);
+            }
+        })
+    );
+
+    // The initial apply only runs once, everything after it is a no-op.
+    acdBenchResult result;
+    size_t allocs = acd_bench_allocs;
+    uint64_t start = acd_bench_ns();
+
+    ctx.Reconcile();
+
+    result.ns = (acd_bench_ns() - start) / max(plan.size(), (size_t)1);
+    result.allocs = acd_bench_allocs - allocs;
+    result.ops = 1;
+
+    acd_bench_report(fh, "apply", ports, patches, result);
+
+    ctx.ResolveSubscriptions();
+
+    acd_bench_report(fh, "steady", ports, patches,
+        acd_bench_run(1, [&]() {
+            plan.clear();
+            acdReconciler::Plan(ctx.config.patches,
+                ctx.sub_map, ctx.address_index, plan);
+        })
+    );
+
+    acd_bench_report(fh, "reconcile", ports, patches,
+        acd_bench_run(1, [&]() { ctx.Reconcile(); })
+    );
+}
+
+static void acd_usage(void)
+{
+    fprintf(stderr, "usage: aconnectd_bench [-p ports] [-n patches]\n");
+    fprintf(stderr, "\t-p, --ports: run a single topology size\n");
+    fprintf(stderr, "\t-n, --patches: run a single patch count\n");
+    fprintf(stderr, "\t-h, --help: print usage\n");
+}
+
+int main(int argc, char *argv[])
+{
+    vector<size_t> sizes_ports = { 10, 100, 1000, 10000 };
+    vector<size_t> sizes_patches = { 10, 100, 1000, 10000, 50000 };
+
+    const struct option long_options[] = {
+        { "ports", required_argument, NULL, 'p' },
+        { "patches", required_argument, NULL, 'n' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "p:n:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'p':
+            sizes_ports = { strtoul(optarg, NULL, 0) };
+            break;
+        case 'n':
+            sizes_patches = { strtoul(optarg, NULL, 0) };
+            break;
+        case 'h':
+        default:
+            acd_usage();
+            return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    // The daemon code logs to stdout, the report goes to the original.
+    FILE *fh = fdopen(dup(STDOUT_FILENO), "w");
+    if (fh == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        fprintf(stderr, "stdout: %s\n", strerror(errno));
+        return 1;
+    }
+
+    fprintf(fh, "%-10s %7s %7s %12s %10s %8s %10s\n",
+        "phase", "ports", "patches", "ns/op", "allocs/cy", "cycles", "rss/KiB"
+    );
+
+    for (auto ports : sizes_ports) {
+        for (auto patches : sizes_patches) {
+            // Not enough distinct port pairs for that many patches.
+            if (ports < 2 || patches > ports * (ports - 1) / 2) continue;
+
+            acd_bench_scenario(fh, ports, patches);
+            fflush(fh);
+        }
+    }
+
+    fclose(fh);
+
+    return 0;
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
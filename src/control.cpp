@@ -0,0 +1,563 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <atomic>
+#include <algorithm>
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include <alsa/asoundlib.h>
+
+#include "nlohmann/json.hpp"
+using json = nlohmann::json;
+
+using namespace std;
+
+#include "aconnectd.h"
+
+// Longest accepted request line.
+#define ACD_CONTROL_LINE_MAX    65536
+// Replies a client may leave unread before it's dropped.
+#define ACD_CONTROL_OUTPUT_MAX  (1 << 20)
+
+enum acdPatchState {
+    psABSENT,
+    psENABLED,
+    psDISABLED
+};
+
+// One patch change of a request, validated before anything is applied.
+class acdControlChange
+{
+public:
+    string cmd;
+    acdPatchKey key;
+    shared_ptr<acdPatch> patch;
+    // "add" only.
+    bool enabled;
+
+    acdControlChange() : enabled(true) { }
+};
+
+static enum acdPatchState acd_control_state(const acdContext &ctx,
+    const map<acdPatchKey, enum acdPatchState> &overlay, const acdPatchKey &key)
+{
+    auto it = overlay.find(key);
+    if (it != overlay.end()) return it->second;
+
+    if (ctx.config.patches.find(key) != ctx.config.patches.end())
+        return psENABLED;
+    if (ctx.config.disabled.find(key) != ctx.config.disabled.end())
+        return psDISABLED;
+
+    return psABSENT;
+}
+
+static bool acd_control_key(const acdContext &ctx,
+    const json &it, acdPatchKey &key)
+{
+    key = acdPatchKey(
+        acdEndpointKey(
+            ctx.names.Find(it.at("src_client").get<string>()),
+            ctx.names.Find(it.at("src_port").get<string>())),
+        acdEndpointKey(
+            ctx.names.Find(it.at("dst_client").get<string>()),
+            ctx.names.Find(it.at("dst_port").get<string>()))
+    );
+
+    return (key.first.first != acdNameTable::invalid &&
+        key.first.second != acdNameTable::invalid &&
+        key.second.first != acdNameTable::invalid &&
+        key.second.second != acdNameTable::invalid);
+}
+
+// Checks a change against the state left by the previous changes of the
+// same request.
+static bool acd_control_validate(acdContext &ctx, const json &request,
+    map<acdPatchKey, enum acdPatchState> &overlay,
+    acdControlChange &change, string &error)
+{
+    try {
+        change.cmd = request.at("cmd").get<string>();
+
+        if (change.cmd != "add" && change.cmd != "remove" &&
+            change.cmd != "enable" && change.cmd != "disable") {
+            error = "unknown command: " + change.cmd;
+            return false;
+        }
+
+        const json &patch = request.at("patch");
+
+        if (change.cmd == "add") {
+            change.patch = make_shared<acdPatch>(
+                acd_patch_parse(patch, ctx.names, change.enabled)
+            );
+            change.key = change.patch->MakeKey();
+            overlay[change.key] = change.enabled ? psENABLED : psDISABLED;
+            return true;
+        }
+
+        if (! acd_control_key(ctx, patch, change.key) ||
+            acd_control_state(ctx, overlay, change.key) == psABSENT) {
+            error = "no such patch";
+            return false;
+        }
+
+        overlay[change.key] =
+            (change.cmd == "remove") ? psABSENT :
+            (change.cmd == "enable") ? psENABLED : psDISABLED;
+    }
+    catch (exception &e) {
+        error = "invalid patch";
+        return false;
+    }
+
+    return true;
+}
+
+static void acd_control_patch(const acdContext &ctx,
+    const acdPatchKey &key, json &patch)
+{
+    patch["src_client"] = ctx.names.Name(key.first.first);
+    patch["src_port"] = ctx.names.Name(key.first.second);
+    patch["dst_client"] = ctx.names.Name(key.second.first);
+    patch["dst_port"] = ctx.names.Name(key.second.second);
+
+    if (ctx.config.disabled.find(key) != ctx.config.disabled.end()) {
+        patch["state"] = "disabled";
+        return;
+    }
+
+    if (ctx.config.patches.find(key) == ctx.config.patches.end()) {
+        patch["state"] = "removed";
+        return;
+    }
+
+    snd_seq_addr_t src, dst;
+
+    if (! ctx.address_index.Lookup(key.first, src) ||
+        ! ctx.address_index.Lookup(key.second, dst)) {
+        patch["state"] = "waiting";
+        return;
+    }
+
+    const acdPort *src_port = ctx.TopologyFind(src);
+
+    if (src_port != NULL &&
+        src_port->subscribers.count(acdSubAddr(dst.client, dst.port)) > 0) {
+        patch["state"] = "subscribed";
+        return;
+    }
+
+    auto it = ctx.backoff.Entries().find(key);
+
+    if (it != ctx.backoff.Entries().end()) {
+        patch["state"] = "failed";
+        patch["error"] = strerror(it->second.error);
+    }
+    else
+        patch["state"] = "pending";
+}
+
+static void acd_control_histogram(const acdHistogram &histogram, json &stats)
+{
+    stats["count"] = histogram.count;
+    if (histogram.count == 0) return;
+
+    stats["min"] = histogram.min;
+    stats["mean"] = histogram.sum / histogram.count;
+    stats["p50"] = histogram.Percentile(50);
+    stats["p90"] = histogram.Percentile(90);
+    stats["p99"] = histogram.Percentile(99);
+    stats["max"] = histogram.max;
+}
+
+static void acd_control_summary(const acdStats::Summary &summary, json &stats)
+{
+    stats["min"] = summary.min;
+    stats["avg"] = summary.avg;
+    stats["max"] = summary.max;
+    stats["p99"] = summary.p99;
+}
+
+acdControl::~acdControl()
+{
+    Close();
+}
+
+bool acdControl::Open(const string &path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+
+    if (path.size() >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Control socket path too long: %s\n", path.c_str());
+        return false;
+    }
+
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+
+    fd_listen = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd_listen < 0) {
+        fprintf(stderr, "socket: %s\n", strerror(errno));
+        return false;
+    }
+
+    // Left behind by an earlier instance.
+    unlink(path.c_str());
+
+    if (bind(fd_listen, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        chmod(path.c_str(), 0660) < 0 || listen(fd_listen, 8) < 0) {
+        fprintf(stderr, "Control socket: %s: %s\n",
+            path.c_str(), strerror(errno));
+        close(fd_listen);
+        fd_listen = -1;
+        return false;
+    }
+
+    this->path = path;
+
+    if (! loop.Add(fd_listen, EPOLLIN, [this](uint32_t) { Accept(); })) {
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+void acdControl::Close(void)
+{
+    while (! connections.empty())
+        Disconnect(connections.begin()->first);
+
+    if (fd_listen == -1) return;
+
+    loop.Remove(fd_listen);
+    close(fd_listen);
+    fd_listen = -1;
+
+    unlink(path.c_str());
+}
+
+void acdControl::Accept(void)
+{
+    int fd;
+
+    while ((fd = accept4(fd_listen, NULL, NULL,
+        SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0) {
+        auto handler = [this, fd](uint32_t events) {
+            if ((events & EPOLLOUT) && ! Output(fd)) return;
+            if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) Input(fd);
+        };
+
+        if (! loop.Add(fd, EPOLLIN, handler)) {
+            close(fd);
+            continue;
+        }
+
+        connections[fd] = acdConnection();
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        fprintf(stderr, "accept: %s\n", strerror(errno));
+}
+
+void acdControl::Disconnect(int fd)
+{
+    loop.Remove(fd);
+    close(fd);
+    connections.erase(fd);
+}
+
+void acdControl::Input(int fd)
+{
+    char buffer[4096];
+    ssize_t bytes = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+    if (bytes <= 0) {
+        Disconnect(fd);
+        return;
+    }
+
+    acdConnection &connection = connections[fd];
+    connection.input.append(buffer, bytes);
+
+    size_t eol;
+    bool change = false;
+
+    while ((eol = connection.input.find('\n')) != string::npos) {
+        string line = connection.input.substr(0, eol), response;
+        connection.input.erase(0, eol + 1);
+
+        if (line.find_first_not_of(" \t\r") == string::npos) continue;
+
+        change |= Execute(line, response);
+        connection.output += response;
+        connection.output += '\n';
+    }
+
+    if (connection.input.size() > ACD_CONTROL_LINE_MAX) {
+        fprintf(stderr, "Control request too long.\n");
+        Disconnect(fd);
+    }
+    else Output(fd);
+
+    if (change && changed) changed();
+}
+
+bool acdControl::Output(int fd)
+{
+    acdConnection &connection = connections[fd];
+
+    while (! connection.output.empty()) {
+        ssize_t bytes = send(fd, connection.output.data(),
+            connection.output.size(), MSG_NOSIGNAL);
+
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+
+        if (bytes <= 0) {
+            Disconnect(fd);
+            return false;
+        }
+
+        connection.output.erase(0, bytes);
+    }
+
+    if (connection.output.size() > ACD_CONTROL_OUTPUT_MAX) {
+        fprintf(stderr, "Control client not reading replies.\n");
+        Disconnect(fd);
+        return false;
+    }
+
+    // Only polled for writing while replies are queued.
+    if (connection.writing == connection.output.empty()) {
+        connection.writing = ! connection.writing;
+        loop.Modify(fd, connection.writing ? EPOLLIN | EPOLLOUT : EPOLLIN);
+    }
+
+    return true;
+}
+
+bool acdControl::Execute(const string &line, string &response)
+{
+    json request, reply;
+
+    try {
+        request = json::parse(line);
+    }
+    catch (exception &e) {
+        reply["ok"] = false;
+        reply["error"] = "JSON parse error";
+        response = reply.dump();
+        return false;
+    }
+
+    string cmd;
+
+    try {
+        cmd = request.at("cmd").get<string>();
+    } catch (exception &e) { }
+
+    reply["ok"] = true;
+
+    if (cmd == "status") {
+        size_t ports = 0, subscriptions = 0;
+
+        for (auto &it_client : ctx.clients) {
+            ports += it_client.second.ports.size();
+            for (auto &it_port : it_client.second.ports)
+                subscriptions += it_port.second.subscribers.size();
+        }
+
+        reply["clients"] = ctx.clients.size();
+        reply["ports"] = ports;
+        reply["subscriptions"] = subscriptions;
+        reply["patches"] = ctx.config.patches.size();
+        reply["disabled"] = ctx.config.disabled.size();
+        reply["failing"] = ctx.backoff.Entries().size();
+        reply["owned"] = ctx.ledger.Size();
+    }
+    else if (cmd == "list") {
+        json patches = json::array();
+
+        for (auto &it : ctx.config.patches) {
+            json patch;
+            acd_control_patch(ctx, it.first, patch);
+            patches.push_back(patch);
+        }
+        for (auto &it : ctx.config.disabled) {
+            json patch;
+            acd_control_patch(ctx, it.first, patch);
+            patches.push_back(patch);
+        }
+
+        reply["patches"] = patches;
+    }
+    else if (cmd == "latency") {
+        json overall, buckets = json::array(), patches = json::array();
+
+        acd_control_histogram(ctx.latency.Overall(), overall);
+
+        const acdHistogram &histogram = ctx.latency.Overall();
+
+        for (unsigned i = 0; i < ACD_HISTOGRAM_BUCKETS; i++) {
+            if (histogram.Count(i) == 0) continue;
+
+            json bucket;
+            if (i < ACD_HISTOGRAM_BUCKETS - 1)
+                bucket["le"] = acdHistogram::BucketUpper(i);
+            else
+                bucket["le"] = "inf";
+            bucket["count"] = histogram.Count(i);
+            buckets.push_back(bucket);
+        }
+
+        overall["buckets"] = buckets;
+
+        for (auto &it : ctx.latency.Entries()) {
+            json patch;
+            acd_control_patch(ctx, it.first, patch);
+            acd_control_histogram(it.second.histogram, patch);
+            patches.push_back(patch);
+        }
+
+        reply["unit"] = "us";
+        reply["overall"] = overall;
+        reply["patches"] = patches;
+    }
+    else if (cmd == "stats") {
+        json phases = json::object();
+
+        for (unsigned i = 0; i < acdStats::phCOUNT; i++) {
+            enum acdStats::Phase phase = (enum acdStats::Phase)i;
+            if (ctx.stats.Cycles(phase) == 0) continue;
+
+            json stats, calls = json::object();
+
+            stats["cycles"] = ctx.stats.Cycles(phase);
+            acd_control_summary(ctx.stats.Wall(phase), stats["wall_ns"]);
+            acd_control_summary(ctx.stats.Cpu(phase), stats["cpu_ns"]);
+
+            for (unsigned j = 0; j < acdStats::caCOUNT; j++) {
+                enum acdStats::Call call = (enum acdStats::Call)j;
+                if (ctx.stats.Total(phase, call) == 0) continue;
+
+                json summary;
+                acd_control_summary(ctx.stats.Calls(phase, call), summary);
+                summary["total"] = ctx.stats.Total(phase, call);
+                calls[acdStats::CallName(call)] = summary;
+            }
+
+            stats["calls"] = calls;
+            phases[acdStats::PhaseName(phase)] = stats;
+        }
+
+        reply["window"] = ACD_STATS_WINDOW;
+        reply["phases"] = phases;
+    }
+    else if (cmd == "reconcile") {
+        ctx.Reconcile();
+        response = reply.dump();
+        return true;
+    }
+    else {
+        // Single changes and batches are validated as a whole, then
+        // applied with one reconcile.
+        vector<acdControlChange> changes;
+        map<acdPatchKey, enum acdPatchState> overlay;
+        string error;
+
+        json batch = json::array();
+
+        if (cmd == "batch") {
+            try {
+                batch = request.at("commands");
+            } catch (exception &e) { }
+
+            if (! batch.is_array() || batch.empty()) {
+                reply["ok"] = false;
+                reply["error"] = "batch without commands";
+                response = reply.dump();
+                return false;
+            }
+        }
+        else
+            batch.push_back(request);
+
+        for (size_t i = 0; i < batch.size(); i++) {
+            acdControlChange change;
+
+            if (! acd_control_validate(ctx, batch[i], overlay, change, error)) {
+                reply["ok"] = false;
+                reply["error"] = error;
+                if (cmd == "batch") reply["index"] = i;
+                response = reply.dump();
+                return false;
+            }
+
+            changes.push_back(change);
+        }
+
+        set<acdPatchKey> keys;
+
+        for (auto &change : changes) {
+            if (change.cmd == "add" && change.enabled) {
+                // No longer removed with the endpoints a rule matched.
+                ctx.config.expanded.erase(change.key);
+                ctx.AddPatch(*change.patch);
+            }
+            else if (change.cmd == "add") {
+                // Replaces an enabled patch too.
+                ctx.RemovePatch(change.key);
+                ctx.config.disabled.insert(make_pair(change.key, *change.patch));
+            }
+            else if (change.cmd == "remove")
+                ctx.RemovePatch(change.key);
+            else if (change.cmd == "enable")
+                ctx.EnablePatch(change.key);
+            else
+                ctx.DisablePatch(change.key);
+
+            keys.insert(change.key);
+        }
+
+        ctx.Reconcile(keys);
+
+        json patches = json::array();
+
+        for (auto &key : keys) {
+            json patch;
+            acd_control_patch(ctx, key, patch);
+            patches.push_back(patch);
+        }
+
+        reply["patches"] = patches;
+        response = reply.dump();
+        return true;
+    }
+
+    response = reply.dump();
+    return false;
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
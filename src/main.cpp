@@ -3,6 +3,14 @@
 #include <iostream>
 #include <vector>
 #include <map>
+#include <set>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <algorithm>
 
 #include <cstdio>
 #include <cctype>
@@ -15,9 +23,16 @@
 #include <ctime>
 
 #include <getopt.h>
+#include <poll.h>
+#include <unistd.h>
 
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <alsa/asoundlib.h>
 
@@ -28,318 +43,8 @@ using namespace std;
 
 #include "aconnectd.h"
 
-static acdConfig acd_config;
-
-static acdSubAddrMap acd_sub_addr_map;
-static acdSubMap acd_sub_map;
-
-static map<int, acdClient> acd_clients;
-
-void acdConfig::Load(const string &filename)
-{
-    json j;
-    ifstream ifs(filename);
-    if (! ifs.is_open()) {
-        fprintf(stderr, "Error loading configuration: %s: %s\n",
-            filename.c_str(), strerror(ENOENT));
-        return;
-    }
-
-    try {
-        ifs >> j;
-    }
-    catch (exception &e) {
-        fprintf(stderr, "Error loading configuration: %s: JSON parse error\n",
-            filename.c_str());
-        return;
-    }
-
-    try {
-        refresh_ttl = j["refresh_ttl"].get<unsigned>();
-    } catch (...) { }
-
-    try {
-        patches.clear();
-
-        for (auto &it : j["patches"]) {
-            int queue = 0;
-            int convert_real = 0;
-            int convert_time = 0;
-            bool exclusive = false;
-
-            try {
-                if (! it["enabled"].get<bool>()) continue;
-            } catch (...) { }
-
-            try {
-                string mode = it["convert_time_mode"].get<string>();
-                if (mode == "real") {
-                    convert_time = 1;
-                    convert_real = 1;
-                }
-                else if (mode == "tick") {
-                    convert_time = 1;
-                    convert_real = 0;
-                }
-
-                queue = it["convert_time_queue"].get<int>();
-            } catch (...) { }
-
-            try {
-                exclusive = it["exclusive"].get<bool>();
-            } catch (...) { }
-
-            acdPatch patch(
-                it["src_client"].get<string>(),
-                it["src_port"].get<string>(),
-                it["dst_client"].get<string>(),
-                it["dst_port"].get<string>(),
-                queue, convert_real, convert_time, exclusive
-            );
-
-            pair<string, string> key;
-            patch.MakeKey(key);
-
-            patches.insert(make_pair(key, patch));
-        }
-    } catch (...) { }
-}
-
-size_t acdClient::AddPorts(const acdClient &client,
-    snd_seq_t *seq, snd_seq_client_info_t *cinfo) {
-
-    ports.clear();
-
-    snd_seq_port_info_t *pinfo;
-    snd_seq_port_info_alloca(&pinfo);
-
-    snd_seq_port_info_set_port(pinfo, -1);
-    snd_seq_port_info_set_client(
-        pinfo,
-        snd_seq_client_info_get_client(cinfo)
-    );
-
-    while (snd_seq_query_next_port(seq, pinfo) >= 0) {
-        acdPort port(client, pinfo);
-
-        auto it = ports.insert(make_pair(port.id, port));
-
-        if (it.second == true) {
-            if (acd_config.verbose) {
-                fprintf(stdout, "Inserted port: %d: %s\n",
-                    port.id, port.name.c_str()
-                );
-            }
-
-            it.first->second.AddSubscriptions(seq, pinfo);
-        }
-    }
-
-    return ports.size();
-}
-
-size_t acdPort::AddSubscriptions(snd_seq_t *seq, snd_seq_port_info_t *pinfo)
-{
-    snd_seq_query_subscribe_t *subs;
-    snd_seq_query_subscribe_alloca(&subs);
-
-    snd_seq_query_subscribe_set_root(
-        subs,
-        snd_seq_port_info_get_addr(pinfo)
-    );
-
-    size_t count = 0;
-    count += AddSubscriptions(seq, subs, SND_SEQ_QUERY_SUBS_READ);
-    //count += AddSubscriptions(seq, subs, SND_SEQ_QUERY_SUBS_WRITE);
-
-    return count;
-}
-
-size_t acdPort::AddSubscriptions(snd_seq_t *seq,
-    snd_seq_query_subscribe_t *subs, snd_seq_query_subs_type_t type)
-{
-    size_t count = 0;
-    snd_seq_query_subscribe_set_type(subs, type);
-    snd_seq_query_subscribe_set_index(subs, 0);
-
-    while (snd_seq_query_port_subscribers(seq, subs) >= 0) {
-        const snd_seq_addr_t *addr;
-
-        addr = snd_seq_query_subscribe_get_addr(subs);
-
-        acd_sub_addr_map.push_back(
-            make_pair(
-                acdSubAddr(client.id, id),
-                make_pair(
-                    acdSubAddr(addr->client, addr->port),
-                    type
-                )
-            )
-        );
-
-        if (acd_config.verbose) {
-            fprintf(stdout, "Inserted subscription: %d:%d %s %d:%d: %d\n",
-                client.id, id,
-                (type == SND_SEQ_QUERY_SUBS_READ) ? "->" : "<-",
-                addr->client, addr->port, type
-            );
-        }
-
-        count++;
-
-        snd_seq_query_subscribe_set_index(subs,
-            snd_seq_query_subscribe_get_index(subs) + 1
-        );
-    }
-
-    return count;
-}
-
-bool acdSubscription::GetAddress(
-    snd_seq_t *seq, const acdPatch &patch, snd_seq_addr_t &addr, enum AddrType atype)
-{
-    string client, port;
-
-    switch (atype) {
-    case atSRC:
-        client = patch.src_client;
-        port = patch.src_port;
-        break;
-
-    case atDST:
-    default:
-        client = patch.dst_client;
-        port = patch.dst_port;
-        break;
-    }
-
-    for (auto &it_client : acd_clients) {
-        if (client != it_client.second.name) continue;
-
-        for (auto &it_port : it_client.second.ports) {
-            if (port != it_port.second.name) continue;
-
-            const string a(
-                to_string(it_client.first) + ":" + to_string(it_port.first)
-            );
-
-            if (snd_seq_parse_address(seq, &addr, a.c_str()) < 0) {
-                fprintf(stderr, "Invalid address: %s/%s (%d:%d)\n",
-                    client.c_str(), port.c_str(), it_client.first, it_port.first
-                );
-
-                return false;
-            }
-
-            return true;
-        }
-    }
-
-    return false;
-}
-
-bool acdSubscription::GetAddress(snd_seq_t *seq,
-    const acdSubscription &subscription, snd_seq_addr_t &addr, enum AddrType atype)
-{
-    string a;
-
-    switch (atype) {
-    case atSRC:
-        a = to_string(subscription.src_client.id) +
-            ":" + to_string(subscription.src_port.id);
-        break;
-
-    case atDST:
-    default:
-        a = to_string(subscription.dst_client.id) +
-            ":" + to_string(subscription.dst_port.id);
-        break;
-    }
-
-    if (snd_seq_parse_address(seq, &addr, a.c_str()) < 0) {
-        fprintf(stderr, "Invalid address: %s\n", a.c_str());
-        return false;
-    }
-
-    return true;
-}
-
-bool acdSubscription::Add(snd_seq_t *seq, const acdPatch &patch)
-{
-    snd_seq_addr_t src, dst;
-
-    if (! acdSubscription::GetAddress(seq, patch, src, atSRC)) return false;
-    if (! acdSubscription::GetAddress(seq, patch, dst, atDST)) return false;
-
-    snd_seq_port_subscribe_t *sub;
-    snd_seq_port_subscribe_alloca(&sub);
-
-    snd_seq_port_subscribe_set_queue(sub, patch.queue);
-    snd_seq_port_subscribe_set_exclusive(sub, patch.exclusive);
-    snd_seq_port_subscribe_set_time_update(sub, patch.convert_time);
-    snd_seq_port_subscribe_set_time_real(sub, patch.convert_real);
-
-    if (acdSubscription::Execute(seq, sub, src, dst, etSUBSCRIBE)) {
-        pair<string, string> key;
-        patch.MakeKey(key);
-        fprintf(stdout, "Subscribed: %s -> %s\n",
-            key.first.c_str(), key.second.c_str()
-        );
-        return true;
-    }
-
-    return false;
-}
-
-bool acdSubscription::Remove(snd_seq_t *seq, const acdSubscription &subscription)
-{
-    snd_seq_addr_t src, dst;
-
-    if (! acdSubscription::GetAddress(seq, subscription, src, atSRC)) return false;
-    if (! acdSubscription::GetAddress(seq, subscription, dst, atDST)) return false;
-
-    snd_seq_port_subscribe_t *sub;
-    snd_seq_port_subscribe_alloca(&sub);
-
-    if (acdSubscription::Execute(seq, sub, src, dst, etUNSUBSCRIBE)) {
-        pair<string, string> key;
-        subscription.MakeKey(key);
-        fprintf(stdout, "Unsubscribed: %s -> %s\n",
-            key.first.c_str(), key.second.c_str()
-        );
-        return true;
-    }
-
-    return false;
-}
-
-bool acdSubscription::Execute(
-    snd_seq_t *seq, snd_seq_port_subscribe_t *sub,
-    snd_seq_addr_t &src, snd_seq_addr_t &dst, enum ExecType etype)
-{
-    snd_seq_port_subscribe_set_sender(sub, &src);
-    snd_seq_port_subscribe_set_dest(sub, &dst);
-
-    switch (etype) {
-    case etSUBSCRIBE:
-        if (snd_seq_subscribe_port(seq, sub) < 0) {
-            fprintf(stderr, "Failed to subscribe: %s\n", snd_strerror(errno));
-            return false;
-        }
-
-        break;
-
-    case etUNSUBSCRIBE:
-    default:
-        if (snd_seq_unsubscribe_port(seq, sub) < 0) {
-            fprintf(stderr, "Failed to unsubscribe: %s\n", snd_strerror(errno));
-            return false;
-        }
-        break;
-    }
-
-    return true;
-}
+// Runtime state, see deploy/systemd/aconnectd.service.
+#define ACD_STATE_DIR   "/run/aconnectd"
 
 static void acd_error(
     const char *file __attribute__((unused)),
@@ -358,120 +63,93 @@ static void acd_error(
     va_end(arg);
 }
 
-static void acd_refresh(snd_seq_t *seq)
+static void acd_notify(const char *state)
 {
-    acd_clients.clear();
+    const char *path = getenv("NOTIFY_SOCKET");
+    if (path == NULL || (path[0] != '/' && path[0] != '@')) return;
 
-    acd_sub_addr_map.clear();
-    acd_sub_map.clear();
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(struct sockaddr_un));
+    sa.sun_family = AF_UNIX;
 
-    snd_seq_client_info_t *cinfo;
-    snd_seq_client_info_alloca(&cinfo);
-    snd_seq_client_info_set_client(cinfo, -1);
+    size_t length = strlen(path);
+    if (length >= sizeof(sa.sun_path)) return;
+    memcpy(sa.sun_path, path, length);
+    // Abstract namespace socket.
+    if (sa.sun_path[0] == '@') sa.sun_path[0] = '\0';
 
-    while (snd_seq_query_next_client(seq, cinfo) >= 0) {
-
-        if (snd_seq_client_info_get_client(
-            cinfo) == acd_config.my_id) continue;
-
-        acdClient client(cinfo);
-
-        auto it = acd_clients.insert(make_pair(client.id, client));
-
-        if (it.second == true) {
-            if (acd_config.verbose) {
-                fprintf(stdout, "Inserted client: %d: %s\n",
-                    client.id, client.name.c_str()
-                );
-            }
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return;
 
-            it.first->second.AddPorts(it.first->second, seq, cinfo);
-        }
+    if (sendto(fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *)&sa,
+        offsetof(struct sockaddr_un, sun_path) + length) < 0) {
+        fprintf(stderr, "sd_notify: %s\n", strerror(errno));
     }
+
+    close(fd);
 }
 
-static void acd_resolve_subscriptions(void)
+static bool acd_timer_arm(int fd, uint64_t delay)
 {
-    for (auto &it_sub : acd_sub_addr_map) {
-
-        auto it_src_client = acd_clients.find(it_sub.first.first);
-
-        if (it_src_client == acd_clients.end()) {
-            fprintf(stderr, "Subscription from invalid source client: %d\n",
-                it_sub.first.first
-            );
-            continue;
-        }
+    struct itimerspec its;
+    memset(&its, 0, sizeof(struct itimerspec));
 
-        auto it_src_port = (*it_src_client).second.ports.find(it_sub.first.second);
+    // A zero it_value disarms the timer, fire "now" instead.
+    if (delay == 0) delay = 1;
 
-        if (it_src_port == (*it_src_client).second.ports.end()) {
-            fprintf(stderr, "Subscription from invalid source address: %d:%d\n",
-                it_sub.first.first, it_sub.first.second
-            );
-            continue;
-        }
+    its.it_value.tv_sec = delay / 1000;
+    its.it_value.tv_nsec = (delay % 1000) * 1000000;
 
-        auto it_dst_client = acd_clients.find(it_sub.second.first.first);
+    if (timerfd_settime(fd, 0, &its, NULL) < 0) {
+        fprintf(stderr, "timerfd_settime: %s\n", strerror(errno));
+        return false;
+    }
 
-        if (it_dst_client == acd_clients.end()) {
-            fprintf(stderr, "Subscription from invalid destination client: %d\n",
-                it_sub.second.first.first
-            );
-            continue;
-        }
+    return true;
+}
 
-        auto it_dst_port = (*it_dst_client).second.ports.find(it_sub.second.first.second);
+static bool acd_timer_set(int fd, unsigned ttl)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(struct itimerspec));
 
-        if (it_dst_port == (*it_dst_client).second.ports.end()) {
-            fprintf(stderr, "Subscription from invalid source address: %d:%d\n",
-                it_sub.second.first.first, it_sub.second.first.second
-            );
-            continue;
-        }
+    its.it_value.tv_sec = ttl;
+    its.it_interval.tv_sec = ttl;
 
-        acdSubscription subscription(
-            (*it_src_client).second, (*it_src_port).second,
-            (*it_dst_client).second, (*it_dst_port).second,
-            (snd_seq_query_subs_type_t)it_sub.second.second
-        );
-
-        pair<string, string> key;
-        subscription.MakeKey(key);
-
-        auto it = acd_sub_map.insert(
-            make_pair(key, subscription)
-        );
-
-        if (it.second == true &&
-            it_sub.second.second == SND_SEQ_QUERY_SUBS_READ) {
-            if (acd_config.verbose) {
-                fprintf(stdout, "Resolved subscription: %s -> %s\n",
-                    it.first->first.first.c_str(),
-                    it.first->first.second.c_str()
-                );
-            }
-        }
+    if (timerfd_settime(fd, 0, &its, NULL) < 0) {
+        fprintf(stderr, "timerfd_settime: %s\n", strerror(errno));
+        return false;
     }
+
+    return true;
 }
 
 int main(int argc, char *argv[])
 {
     int rc = 0;
-    bool terminate = true;
+    bool oneshot = false;
+    bool dry_run = false;
+    bool verbose = false;
+    bool terminate = false;
     string config_file("/etc/aconnectd.json");
+    string control_path(ACD_STATE_DIR "/control");
+    string metrics_address;
 
     static const struct option acd_options[] = {
         { "help", 0, NULL, 'h' },
         { "config", 1, NULL, 'c' },
         { "daemon", 0, NULL, 'd' },
+        { "dry-run", 0, NULL, 'n' },
+        { "metrics", 1, NULL, 'm' },
+        { "oneshot", 0, NULL, 'o' },
+        { "socket", 1, NULL, 's' },
         { "verbose", 0, NULL, 'v' },
 
         { NULL, 0, NULL, 0 },
     };
 
     while (true) {
-        if ((rc = getopt_long(argc, argv, "dvh", acd_options, NULL)) == -1) break;
+        if ((rc = getopt_long(argc, argv, "c:dm:nos:vh", acd_options, NULL)) == -1) break;
 
         switch (rc) {
         case 0:
@@ -480,117 +158,214 @@ int main(int argc, char *argv[])
             fprintf(stderr, "Try `--help' for more information.\n");
             return 1;
         case 'h':
-            fprintf(stdout, "%s [-c, --config <file>] [-d, --daemon] [-v, --verbose]\n", argv[0]);
+            fprintf(stdout, "%s [-c, --config <file>] [-d, --daemon] [-m, --metrics <address>] [-n, --dry-run] [-o, --oneshot] [-s, --socket <path>] [-v, --verbose]\n", argv[0]);
             return 0;
         case 'c':
             config_file = optarg;
             break;
         case 'd':
-            terminate = false;
             if (daemon(1, 1) != 0) {
                 fprintf(stderr, "daemon: %s\n", strerror(errno));
                 return 1;
             }
             break;
+        case 'm':
+            metrics_address = optarg;
+            break;
+        case 'n':
+            dry_run = true;
+            break;
+        case 'o':
+            oneshot = true;
+            break;
+        case 's':
+            control_path = optarg;
+            break;
         case 'v':
-            acd_config.verbose = true;
+            verbose = true;
             break;
         }
     }
 
     fprintf(stdout, "aconnectd v%s\n", PACKAGE_VERSION);
 
-    acd_config.Load(config_file);
-
     snd_lib_error_set_handler(acd_error);
 
-    snd_seq_t *seq;
-    if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, 0) < 0)
-        return 1;
+    acdSequencerALSA alsa;
+    if (alsa.Open("aconnectd") < 0) return 1;
 
-    if (snd_seq_set_client_name(seq, "aconnectd") < 0) {
-        snd_seq_close(seq);
-        fprintf(stderr, "Error setting client name.\n");
-        return 1;
-    }
+    acdSequencer *seq = &alsa;
+    acdContext ctx(seq);
+
+    ctx.config.dry_run = dry_run;
+    ctx.config.verbose = verbose;
+    ctx.config.Load(config_file, ctx.names);
+
+    ctx.ledger_file = ACD_STATE_DIR "/ledger.json";
+    ctx.ledger.Load(ctx.ledger_file, ctx.names);
 
-    acd_config.my_id = snd_seq_client_id(seq);
+    ctx.status_page.Open(ACD_STATE_DIR "/status");
+
+    if (oneshot) {
+        ctx.Refresh();
+        ctx.Reconcile();
+        return 0;
+    }
 
-    time_t last_refresh = 0;
+    if (seq->SubscribeAnnounce() < 0) return 1;
 
     sigset_t sigset;
-    struct timespec tspec_sigwait = { acd_config.refresh_ttl, 0 };
+    sigfillset(&sigset);
+    sigdelset(&sigset, SIGQUIT);
+    sigprocmask(SIG_BLOCK, &sigset, NULL);
+
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGHUP);
+    sigaddset(&sigset, SIGINT);
+    sigaddset(&sigset, SIGTERM);
+    sigaddset(&sigset, SIGUSR1);
+
+    int fd_signal = signalfd(-1, &sigset, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd_signal < 0) {
+        fprintf(stderr, "signalfd: %s\n", strerror(errno));
+        return 1;
+    }
+
+    int fd_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd_timer < 0) {
+        fprintf(stderr, "timerfd_create: %s\n", strerror(errno));
+        close(fd_signal);
+        return 1;
+    }
 
-    if (! terminate) {
-        sigfillset(&sigset);
-        sigdelset(&sigset, SIGQUIT);
-        sigprocmask(SIG_BLOCK, &sigset, NULL);
+    acd_timer_set(fd_timer, ctx.config.refresh_ttl);
 
-        sigemptyset(&sigset);
-        sigaddset(&sigset, SIGHUP);
-        sigaddset(&sigset, SIGINT);
-        sigaddset(&sigset, SIGTERM);
+    int fd_retry = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd_retry < 0) {
+        fprintf(stderr, "timerfd_create: %s\n", strerror(errno));
+        close(fd_timer);
+        close(fd_signal);
+        return 1;
     }
 
-    rc = 0;
+    auto retry_arm = [&ctx, fd_retry]() {
+        uint64_t now = acd_time_ms(), when;
+
+        if (ctx.backoff.NextRetry(when))
+            acd_timer_arm(fd_retry, (when > now) ? when - now : 0);
+        else
+            acd_timer_set(fd_retry, 0);
+    };
 
-    do {
-        if (time(NULL) >= last_refresh + acd_config.refresh_ttl) {
-            acd_refresh(seq);
-            acd_resolve_subscriptions();
+    bool ready = false, reconcile = true, touched = false;
+    acdEventLoop loop;
 
-            for (auto &it : acd_config.patches) {
-                auto it_sub = acd_sub_map.find(it.first);
+    if (! loop.Create()) rc = 1;
 
-                if (it_sub == acd_sub_map.end())
-                    acdSubscription::Add(seq, it.second);
+    if (rc == 0 && ! loop.Add(fd_signal, EPOLLIN,
+        [&ctx, &config_file, &retry_arm, fd_signal, fd_timer, &terminate](uint32_t) {
+            struct signalfd_siginfo si;
+
+            while (read(fd_signal, &si, sizeof(si)) == sizeof(si)) {
+                if (si.ssi_signo == SIGHUP) {
+                    fprintf(stdout, "Reloading...\n");
+                    if (ctx.Reload(config_file)) {
+                        acd_timer_set(fd_timer, ctx.config.refresh_ttl);
+                        retry_arm();
+                    }
+                    fflush(stdout);
+                }
+                else if (si.ssi_signo == SIGUSR1) {
+                    ctx.StatusDump(stdout);
+                    fflush(stdout);
+                }
+                else if (si.ssi_signo == SIGINT || si.ssi_signo == SIGTERM) {
+                    acd_notify("STOPPING=1");
+                    fprintf(stdout, "Terminating...\n");
+                    if (ctx.config.handoff)
+                        ctx.SnapshotSave(ACD_STATE_DIR "/snapshot.json");
+                    else {
+                        ctx.Refresh();
+                        ctx.Reconcile(map<acdPatchKey, acdPatch>());
+                    }
+                    terminate = true;
+                }
             }
+        })) rc = 1;
 
-            for (auto &it : acd_sub_map) {
-                auto it_patch = acd_config.patches.find(it.first);
+    if (rc == 0 && ! loop.Add(fd_timer, EPOLLIN,
+        [&ctx, fd_timer, &reconcile](uint32_t) {
+            uint64_t expirations;
 
-                if (it_patch == acd_config.patches.end())
-                    acdSubscription::Remove(seq, it.second);
+            if (read(fd_timer, &expirations, sizeof(expirations)) > 0) {
+                ctx.Refresh();
+                reconcile = true;
             }
+        })) rc = 1;
+
+    if (rc == 0 && ! loop.Add(fd_retry, EPOLLIN,
+        [fd_retry, &reconcile](uint32_t) {
+            uint64_t expirations;
+
+            if (read(fd_retry, &expirations, sizeof(expirations)) > 0)
+                reconcile = true;
+        })) rc = 1;
+
+    // The control socket is optional, an empty path disables it.
+    acdControl control(ctx, loop);
 
-            last_refresh = time(NULL);
+    if (rc == 0 && ! control_path.empty() && control.Open(control_path)) {
+        control.changed = [&retry_arm]() {
             fflush(stdout);
-        }
+            retry_arm();
+        };
+    }
 
-        if (! terminate) {
-            int sid;
-            siginfo_t si;
+    // Disabled unless an address is given.
+    acdMetricsServer metrics(ctx, loop);
 
-            if ((sid = sigtimedwait(&sigset, &si, &tspec_sigwait)) < 0) {
-                if (errno == EAGAIN || errno == EINTR) {
-                    sleep(1);
-                    continue;
-                }
-                rc = -1;
-                terminate = true;
-                fprintf(stderr, "sigwaitinfo: %s\n", strerror(errno));
-                break;
-            }
+    if (rc == 0 && ! metrics_address.empty()) metrics.Open(metrics_address);
 
-            if (sid == SIGHUP) {
-                fprintf(stdout, "Reloading...\n");
-                acd_config.Load("/etc/aconnectd.json");
-                last_refresh = 0;
-                tspec_sigwait = { acd_config.refresh_ttl, 0 };
-            }
-            else if (sid == SIGINT || sid == SIGTERM) {
-                acd_refresh(seq);
-                acd_resolve_subscriptions();
-                fprintf(stdout, "Terminating...\n");
-                for (auto &it : acd_sub_map)
-                    acdSubscription::Remove(seq, it.second);
-                terminate = true;
+    vector<struct pollfd> pfds;
+    if (rc == 0 && seq->PollDescriptors(pfds) < 0) rc = 1;
+
+    for (auto &pfd : pfds) {
+        if (rc != 0) break;
+        if (! loop.Add(pfd.fd, EPOLLIN, [&ctx, &touched](uint32_t) {
+            if (ctx.ProcessEvents()) touched = true;
+        })) rc = 1;
+    }
+
+    if (rc == 0) {
+        ctx.Refresh();
+        ctx.SnapshotAdopt(ACD_STATE_DIR "/snapshot.json");
+    }
+
+    while (rc == 0 && ! terminate) {
+        if (reconcile || touched) {
+            // Announce events only touch the patches of their endpoints.
+            if (reconcile)
+                ctx.Reconcile();
+            else
+                ctx.ReconcileTouched();
+
+            reconcile = touched = false;
+            fflush(stdout);
+
+            retry_arm();
+
+            if (! ready) {
+                acd_notify("READY=1");
+                ready = true;
             }
         }
+
+        if (loop.Dispatch() < 0) rc = 1;
     }
-    while (! terminate);
 
-    snd_seq_close(seq);
+    close(fd_retry);
+    close(fd_timer);
+    close(fd_signal);
 
     return rc;
 }
@@ -0,0 +1,380 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cstdarg>
+#include <cerrno>
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <alsa/asoundlib.h>
+
+using namespace std;
+
+#include "aconnectd.h"
+
+// Longest accepted request head.
+#define ACD_METRICS_REQUEST_MAX 8192
+
+static void acd_metrics_printf(string &text, const char *format, ...)
+{
+    char buffer[512];
+    va_list arg;
+
+    va_start(arg, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, arg);
+    va_end(arg);
+
+    if (length > 0)
+        text.append(buffer, min((size_t)length, sizeof(buffer) - 1));
+}
+
+static void acd_metrics_header(string &text,
+    const char *name, const char *type, const char *help)
+{
+    acd_metrics_printf(text, "# HELP %s %s\n# TYPE %s %s\n",
+        name, help, name, type);
+}
+
+static void acd_metrics_value(string &text,
+    const char *name, const char *type, const char *help, uint64_t value)
+{
+    acd_metrics_header(text, name, type, help);
+    acd_metrics_printf(text, "%s %lu\n", name, (unsigned long)value);
+}
+
+static void acd_metrics_seconds(string &text,
+    const char *name, const char *type, const char *help, uint64_t us)
+{
+    acd_metrics_header(text, name, type, help);
+    acd_metrics_printf(text, "%s %lu.%06lu\n", name,
+        (unsigned long)(us / 1000000), (unsigned long)(us % 1000000));
+}
+
+acdMetricsServer::~acdMetricsServer()
+{
+    Close();
+}
+
+bool acdMetricsServer::Open(const string &address)
+{
+    if (! address.empty() && address[0] == '/') {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(struct sockaddr_un));
+
+        if (address.size() >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Metrics socket path too long: %s\n",
+                address.c_str());
+            return false;
+        }
+
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, address.c_str());
+
+        fd_listen = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd_listen < 0) {
+            fprintf(stderr, "socket: %s\n", strerror(errno));
+            return false;
+        }
+
+        // Left behind by an earlier instance.
+        unlink(address.c_str());
+
+        if (bind(fd_listen, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            chmod(address.c_str(), 0660) < 0) {
+            fprintf(stderr, "Metrics socket: %s: %s\n",
+                address.c_str(), strerror(errno));
+            close(fd_listen);
+            fd_listen = -1;
+            return false;
+        }
+
+        path = address;
+    }
+    else {
+        // Only ever bound to the loopback interface.
+        string port = address;
+
+        if (port.compare(0, 10, "localhost:") == 0)
+            port.erase(0, 10);
+        else if (port.compare(0, 10, "127.0.0.1:") == 0)
+            port.erase(0, 10);
+
+        char *end;
+        unsigned long number = strtoul(port.c_str(), &end, 10);
+
+        if (port.empty() || *end != '\0' || number == 0 || number > 65535) {
+            fprintf(stderr, "Invalid metrics address: %s\n", address.c_str());
+            return false;
+        }
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(struct sockaddr_in));
+
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)number);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        fd_listen = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd_listen < 0) {
+            fprintf(stderr, "socket: %s\n", strerror(errno));
+            return false;
+        }
+
+        int on = 1;
+        setsockopt(fd_listen, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+        if (bind(fd_listen, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            fprintf(stderr, "Metrics socket: %s: %s\n",
+                address.c_str(), strerror(errno));
+            close(fd_listen);
+            fd_listen = -1;
+            return false;
+        }
+    }
+
+    if (listen(fd_listen, 8) < 0) {
+        fprintf(stderr, "listen: %s\n", strerror(errno));
+        Close();
+        return false;
+    }
+
+    if (! loop.Add(fd_listen, EPOLLIN, [this](uint32_t) { Accept(); })) {
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+void acdMetricsServer::Close(void)
+{
+    while (! connections.empty())
+        Disconnect(connections.begin()->first);
+
+    if (fd_listen == -1) return;
+
+    loop.Remove(fd_listen);
+    close(fd_listen);
+    fd_listen = -1;
+
+    if (! path.empty()) unlink(path.c_str());
+    path.clear();
+}
+
+void acdMetricsServer::Accept(void)
+{
+    int fd;
+
+    while ((fd = accept4(fd_listen, NULL, NULL,
+        SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0) {
+        auto handler = [this, fd](uint32_t) {
+            if (connections[fd].writing) Output(fd);
+            else Input(fd);
+        };
+
+        if (! loop.Add(fd, EPOLLIN, handler)) {
+            close(fd);
+            continue;
+        }
+
+        connections[fd] = acdConnection();
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        fprintf(stderr, "accept: %s\n", strerror(errno));
+}
+
+void acdMetricsServer::Disconnect(int fd)
+{
+    loop.Remove(fd);
+    close(fd);
+    connections.erase(fd);
+}
+
+// Answers any request once its head is complete, then closes the
+// connection once the response is sent.
+void acdMetricsServer::Input(int fd)
+{
+    char buffer[4096];
+    ssize_t bytes = recv(fd, buffer, sizeof(buffer), 0);
+
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+    if (bytes <= 0) {
+        Disconnect(fd);
+        return;
+    }
+
+    string &request = connections[fd].input;
+    request.append(buffer, bytes);
+
+    if (request.find("\r\n\r\n") == string::npos &&
+        request.find("\n\n") == string::npos) {
+        if (request.size() > ACD_METRICS_REQUEST_MAX) Disconnect(fd);
+        return;
+    }
+
+    string body;
+    Format(body);
+
+    string &response = connections[fd].output;
+
+    acd_metrics_printf(response, "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n\r\n", body.size());
+    response += body;
+    request.clear();
+
+    Output(fd);
+}
+
+void acdMetricsServer::Output(int fd)
+{
+    acdConnection &connection = connections[fd];
+
+    while (! connection.output.empty()) {
+        ssize_t bytes = send(fd, connection.output.data(),
+            connection.output.size(), MSG_NOSIGNAL);
+
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+
+        if (bytes <= 0) {
+            fprintf(stderr, "Metrics: send: %s\n", strerror(errno));
+            Disconnect(fd);
+            return;
+        }
+
+        connection.output.erase(0, bytes);
+    }
+
+    if (connection.output.empty()) {
+        Disconnect(fd);
+        return;
+    }
+
+    // The rest of the request is ignored from now on.
+    if (! connection.writing) {
+        connection.writing = true;
+        loop.Modify(fd, EPOLLOUT);
+    }
+}
+
+void acdMetricsServer::Format(string &text) const
+{
+    const acdMetrics &metrics = ctx.metrics;
+
+    acd_metrics_value(text, "aconnectd_reconciles_total", "counter",
+        "Reconciliations run.",
+        metrics.reconciles.load(memory_order_relaxed));
+
+    acd_metrics_header(text, "aconnectd_reconcile_duration_seconds",
+        "summary", "Time spent reconciling.");
+    acd_metrics_printf(text, "aconnectd_reconcile_duration_seconds_sum %.6f\n",
+        metrics.reconcile_us.load(memory_order_relaxed) / 1e6);
+    acd_metrics_printf(text, "aconnectd_reconcile_duration_seconds_count %lu\n",
+        (unsigned long)metrics.reconciles.load(memory_order_relaxed));
+
+    acd_metrics_seconds(text, "aconnectd_reconcile_last_duration_seconds",
+        "gauge", "Duration of the last reconciliation.",
+        metrics.reconcile_last_us.load(memory_order_relaxed));
+
+    acd_metrics_value(text, "aconnectd_subscriptions_added_total", "counter",
+        "Subscriptions made.",
+        metrics.subscribed.load(memory_order_relaxed));
+    acd_metrics_value(text, "aconnectd_subscriptions_removed_total", "counter",
+        "Subscriptions removed.",
+        metrics.unsubscribed.load(memory_order_relaxed));
+    acd_metrics_value(text, "aconnectd_subscriptions_failed_total", "counter",
+        "Subscription attempts that failed.",
+        metrics.failed.load(memory_order_relaxed));
+
+    size_t ports = 0, subscriptions = 0;
+
+    for (auto &it_client : ctx.clients) {
+        ports += it_client.second.ports.size();
+        for (auto &it_port : it_client.second.ports)
+            subscriptions += it_port.second.subscribers.size();
+    }
+
+    acd_metrics_value(text, "aconnectd_clients", "gauge",
+        "Sequencer clients.", ctx.clients.size());
+    acd_metrics_value(text, "aconnectd_ports", "gauge",
+        "Sequencer ports.", ports);
+    acd_metrics_value(text, "aconnectd_subscriptions", "gauge",
+        "Subscriptions between sequencer ports.", subscriptions);
+
+    // Same states as the control socket reports.
+    size_t subscribed = 0, waiting = 0, failed = 0, pending = 0;
+
+    for (auto &it : ctx.config.patches) {
+        const acdPatchKey &key = it.first;
+        snd_seq_addr_t src, dst;
+
+        if (! ctx.address_index.Lookup(key.first, src) ||
+            ! ctx.address_index.Lookup(key.second, dst)) {
+            waiting++;
+            continue;
+        }
+
+        const acdPort *src_port = ctx.TopologyFind(src);
+
+        if (src_port != NULL &&
+            src_port->subscribers.count(acdSubAddr(dst.client, dst.port)) > 0)
+            subscribed++;
+        else if (ctx.backoff.Entries().find(key) != ctx.backoff.Entries().end())
+            failed++;
+        else
+            pending++;
+    }
+
+    acd_metrics_header(text, "aconnectd_patches", "gauge", "Patches by state.");
+    acd_metrics_printf(text, "aconnectd_patches{state=\"subscribed\"} %zu\n", subscribed);
+    acd_metrics_printf(text, "aconnectd_patches{state=\"waiting\"} %zu\n", waiting);
+    acd_metrics_printf(text, "aconnectd_patches{state=\"failed\"} %zu\n", failed);
+    acd_metrics_printf(text, "aconnectd_patches{state=\"pending\"} %zu\n", pending);
+    acd_metrics_printf(text, "aconnectd_patches{state=\"disabled\"} %zu\n",
+        ctx.config.disabled.size());
+
+    size_t retrying = 0, rejected = 0;
+
+    for (auto &it : ctx.backoff.Entries()) {
+        if (it.second.retry_at == acdBackoff::never)
+            rejected++;
+        else
+            retrying++;
+    }
+
+    acd_metrics_header(text, "aconnectd_backoff_patches", "gauge",
+        "Failing patches, retried on a timer or on topology change only.");
+    acd_metrics_printf(text, "aconnectd_backoff_patches{retry=\"timer\"} %zu\n", retrying);
+    acd_metrics_printf(text, "aconnectd_backoff_patches{retry=\"topology\"} %zu\n", rejected);
+
+    acd_metrics_seconds(text, "aconnectd_event_loop_lag_seconds", "gauge",
+        "Time the event loop last spent busy between waits.", loop.Lag());
+    acd_metrics_seconds(text, "aconnectd_event_loop_lag_max_seconds", "gauge",
+        "Longest time the event loop spent busy between waits.", loop.LagMax());
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
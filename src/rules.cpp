@@ -0,0 +1,630 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
+
+#include <cstdio>
+#include <cstring>
+
+#include <poll.h>
+#include <fnmatch.h>
+#include <regex.h>
+
+#include <alsa/asoundlib.h>
+
+using namespace std;
+
+#include "aconnectd.h"
+
+class acdRegex
+{
+public:
+    regex_t regex;
+    bool compiled;
+
+    acdRegex() : compiled(false) { }
+    virtual ~acdRegex() { if (compiled) regfree(&regex); }
+};
+
+bool acdMatcher::IsPattern(const string &name)
+{
+    return ((! name.empty() && name[0] == '~') ||
+        name.find_first_of("*?[") != string::npos);
+}
+
+void acdMatcher::Compile(const string &name, bool literal)
+{
+    regex.reset();
+    prefix.clear();
+    suffix.clear();
+
+    if (literal || ! IsPattern(name)) {
+        type = mtEXACT;
+        acdNameTable::Normalize(name, pattern);
+        prefix = pattern;
+        return;
+    }
+
+    if (name[0] == '~') {
+        type = mtREGEX;
+        pattern = name.substr(1);
+
+        shared_ptr<acdRegex> compiled = make_shared<acdRegex>();
+        if (regcomp(&compiled->regex, pattern.c_str(),
+            REG_EXTENDED | REG_NOSUB) != 0)
+            throw invalid_argument(pattern);
+
+        compiled->compiled = true;
+        regex = compiled;
+
+        // Literal runs anchored at either end; alternations have none.
+        static const char *special = ".[]()*+?{}|^$\\";
+
+        if (pattern.find('|') != string::npos) return;
+
+        if (pattern[0] == '^') {
+            size_t end = pattern.find_first_of(special, 1);
+            if (end == string::npos) end = pattern.size();
+            prefix = pattern.substr(1, end - 1);
+            // A quantifier makes the last character optional.
+            if (end < pattern.size() && ! prefix.empty() &&
+                strchr("*+?{", pattern[end]) != NULL)
+                prefix.erase(prefix.size() - 1);
+        }
+
+        size_t length = pattern.size();
+
+        if (length > 1 && pattern[length - 1] == '$' &&
+            pattern[length - 2] != '\\') {
+            size_t start = pattern.find_last_of(special, length - 2);
+            start = (start == string::npos) ? 0 : start + 1;
+            suffix = pattern.substr(start, length - 1 - start);
+        }
+
+        return;
+    }
+
+    type = mtGLOB;
+    pattern = name;
+
+    static const char *special = "*?[]\\";
+
+    prefix = pattern.substr(0, pattern.find_first_of(special));
+
+    size_t last = pattern.find_last_of(special);
+    suffix = (last == string::npos) ? pattern : pattern.substr(last + 1);
+}
+
+bool acdMatcher::Match(const string &name) const
+{
+    switch (type) {
+    case mtGLOB:
+        return (fnmatch(pattern.c_str(), name.c_str(), 0) == 0);
+
+    case mtREGEX:
+        return (regexec(&regex->regex, name.c_str(), 0, NULL, 0) == 0);
+
+    case mtEXACT:
+    default:
+        return (name == pattern);
+    }
+}
+
+bool acdPredicate::Test(const acdPort &port) const
+{
+    unsigned attribute;
+
+    switch (field) {
+    case pfCLIENT_TYPE:
+        attribute = (unsigned)port.client.type;
+        break;
+
+    case pfCARD:
+        attribute = (unsigned)port.client.card;
+        break;
+
+    case pfPID:
+        attribute = (unsigned)port.client.pid;
+        break;
+
+    case pfCAPABILITY:
+        attribute = port.capability;
+        break;
+
+    case pfTYPE:
+    default:
+        attribute = port.type;
+        break;
+    }
+
+    return ((attribute & mask) == value);
+}
+
+static bool acd_rule_test(const vector<acdPredicate> &predicates,
+    const acdPort &port)
+{
+    for (auto &predicate : predicates) {
+        if (! predicate.Test(port)) return false;
+    }
+
+    return true;
+}
+
+void acdRuleIndex::Clear(void)
+{
+    rules.clear();
+    unindexed.clear();
+
+    for (unsigned i = 0; i < 2; i++) {
+        for (unsigned j = 0; j < 2; j++) {
+            affixes[i][j].clear();
+            lengths[i][j].clear();
+        }
+    }
+}
+
+void acdRuleIndex::Swap(acdRuleIndex &other)
+{
+    rules.swap(other.rules);
+    unindexed.swap(other.unindexed);
+
+    for (unsigned i = 0; i < 2; i++) {
+        for (unsigned j = 0; j < 2; j++) {
+            affixes[i][j].swap(other.affixes[i][j]);
+            lengths[i][j].swap(other.lengths[i][j]);
+        }
+    }
+}
+
+void acdRuleIndex::Add(const acdRule &rule)
+{
+    unsigned id = rules.size();
+
+    rules.push_back(rule);
+    rules.back().src.clear();
+    rules.back().dst.clear();
+
+    Index(id, sdSRC, rule.src_client, rule.src_port);
+    Index(id, sdDST, rule.dst_client, rule.dst_port);
+}
+
+// Keyed on the longest affix of the side's client and port names.
+void acdRuleIndex::Index(unsigned rule, enum Side side,
+    const acdMatcher &client, const acdMatcher &port)
+{
+    const string *affix[2][2] = {
+        { &client.prefix, &client.suffix },
+        { &port.prefix, &port.suffix }
+    };
+
+    unsigned component = 0, kind = 0;
+
+    for (unsigned i = 0; i < 2; i++) {
+        for (unsigned j = 0; j < 2; j++) {
+            if (affix[i][j]->size() > affix[component][kind]->size()) {
+                component = i;
+                kind = j;
+            }
+        }
+    }
+
+    const string &key = *affix[component][kind];
+
+    if (key.empty()) {
+        unindexed.push_back(Entry(rule, side));
+        return;
+    }
+
+    affixes[component][kind][key].push_back(Entry(rule, side));
+    lengths[component][kind].insert(key.size());
+}
+
+void acdRuleIndex::Candidates(const string &client, const string &port,
+    vector<Entry> &entries) const
+{
+    const string *names[2] = { &client, &port };
+
+    entries = unindexed;
+
+    for (unsigned i = 0; i < 2; i++) {
+        const string &name = *names[i];
+
+        for (unsigned j = 0; j < 2; j++) {
+            for (auto length : lengths[i][j]) {
+                if (length > name.size()) break;
+
+                auto it = affixes[i][j].find((j == 0) ?
+                    name.substr(0, length) :
+                    name.substr(name.size() - length));
+
+                if (it != affixes[i][j].end())
+                    entries.insert(entries.end(), it->second.begin(), it->second.end());
+            }
+        }
+    }
+}
+
+// Attributes are those of the port reported; other ports with the same
+// names aren't considered.
+void acdRuleIndex::Appear(const acdPort &port,
+    const acdNameTable &names, vector<Match> &added)
+{
+    Update(port, names, added, NULL);
+}
+
+void acdRuleIndex::Change(const acdPort &port, const acdNameTable &names,
+    vector<Match> &added, vector<acdPatchKey> &removed)
+{
+    Update(port, names, added, &removed);
+}
+
+// Without removed, only adds the endpoint to the sides it matches.
+void acdRuleIndex::Update(const acdPort &port, const acdNameTable &names,
+    vector<Match> &added, vector<acdPatchKey> *removed)
+{
+    if (rules.empty()) return;
+
+    acdEndpointKey key(port.client.name_id, port.name_id);
+    const string &client_name = names.Name(key.first);
+    const string &port_name = names.Name(key.second);
+    vector<Entry> entries;
+
+    Candidates(client_name, port_name, entries);
+
+    for (auto &entry : entries) {
+        acdRule &rule = rules[entry.rule];
+
+        if (entry.side == sdSRC) {
+            if (! rule.src_client.Match(client_name) ||
+                ! rule.src_port.Match(port_name)) continue;
+
+            if (! acd_rule_test(rule.src_attributes, port)) {
+                if (removed == NULL || rule.src.erase(key) == 0) continue;
+
+                for (auto &dst : rule.dst) {
+                    if (dst != key) removed->push_back(acdPatchKey(key, dst));
+                }
+                continue;
+            }
+
+            if (! rule.src.insert(key).second) continue;
+
+            for (auto &dst : rule.dst) {
+                if (dst != key) added.push_back(Match(acdPatchKey(key, dst), &rule));
+            }
+        }
+        else {
+            if (! rule.dst_client.Match(client_name) ||
+                ! rule.dst_port.Match(port_name)) continue;
+
+            if (! acd_rule_test(rule.dst_attributes, port)) {
+                if (removed == NULL || rule.dst.erase(key) == 0) continue;
+
+                for (auto &src : rule.src) {
+                    if (src != key) removed->push_back(acdPatchKey(src, key));
+                }
+                continue;
+            }
+
+            if (! rule.dst.insert(key).second) continue;
+
+            for (auto &src : rule.src) {
+                if (src != key) added.push_back(Match(acdPatchKey(src, key), &rule));
+            }
+        }
+    }
+}
+
+void acdRuleIndex::Gone(const acdEndpointKey &key,
+    const acdNameTable &names, vector<acdPatchKey> &removed)
+{
+    if (rules.empty()) return;
+
+    vector<Entry> entries;
+
+    Candidates(names.Name(key.first), names.Name(key.second), entries);
+
+    for (auto &entry : entries) {
+        acdRule &rule = rules[entry.rule];
+
+        if (entry.side == sdSRC) {
+            if (rule.src.erase(key) == 0) continue;
+
+            for (auto &dst : rule.dst) {
+                if (dst != key) removed.push_back(acdPatchKey(key, dst));
+            }
+        }
+        else {
+            if (rule.dst.erase(key) == 0) continue;
+
+            for (auto &src : rule.src) {
+                if (src != key) removed.push_back(acdPatchKey(src, key));
+            }
+        }
+    }
+}
+
+void acdRuleIndex::Retain(function<bool(const acdEndpointKey &key)> present,
+    vector<acdPatchKey> &removed)
+{
+    for (auto &rule : rules) {
+        for (auto it = rule.src.begin(); it != rule.src.end(); ) {
+            if (present(*it)) {
+                it++;
+                continue;
+            }
+
+            for (auto &dst : rule.dst) {
+                if (dst != *it) removed.push_back(acdPatchKey(*it, dst));
+            }
+
+            it = rule.src.erase(it);
+        }
+
+        for (auto it = rule.dst.begin(); it != rule.dst.end(); ) {
+            if (present(*it)) {
+                it++;
+                continue;
+            }
+
+            for (auto &src : rule.src) {
+                if (src != *it) removed.push_back(acdPatchKey(src, *it));
+            }
+
+            it = rule.dst.erase(it);
+        }
+    }
+}
+
+void acdTemplate::Compile(const string &text, map<string, unsigned> &variables)
+{
+    segments.clear();
+
+    size_t pos = 0;
+
+    while (pos < text.size()) {
+        size_t open = text.find('{', pos);
+
+        if (open == string::npos) {
+            segments.push_back(Segment(text.substr(pos), -1));
+            break;
+        }
+
+        if (open > pos) segments.push_back(Segment(text.substr(pos, open - pos), -1));
+
+        size_t close = text.find('}', open);
+        if (close == string::npos || close == open + 1)
+            throw invalid_argument(text);
+
+        string name = text.substr(open + 1, close - open - 1);
+
+        // Numbered in order of first use.
+        auto it = variables.insert(make_pair(name, (unsigned)variables.size())).first;
+        segments.push_back(Segment(string(), (int)it->second));
+
+        pos = close + 1;
+    }
+}
+
+void acdTemplate::Expand(const vector<string> &values, string &name) const
+{
+    name.clear();
+
+    for (auto &segment : segments)
+        name += (segment.variable < 0) ? segment.literal : values[segment.variable];
+}
+
+void acdTemplate::Match(const string &name, vector<string> &values,
+    vector<bool> &bound, function<void()> found) const
+{
+    Match(name, 0, 0, values, bound, found);
+}
+
+void acdTemplate::Match(const string &name, size_t pos, size_t segment,
+    vector<string> &values, vector<bool> &bound,
+    function<void()> &found) const
+{
+    if (segment == segments.size()) {
+        if (pos == name.size()) found();
+        return;
+    }
+
+    const Segment &s = segments[segment];
+
+    if (s.variable < 0 || bound[s.variable]) {
+        const string &literal = (s.variable < 0) ? s.literal : values[s.variable];
+
+        if (name.compare(pos, literal.size(), literal) == 0)
+            Match(name, pos + literal.size(), segment + 1, values, bound, found);
+        return;
+    }
+
+    // Every split, an ambiguous name may bind several ways.
+    bound[s.variable] = true;
+
+    for (size_t length = 0; pos + length <= name.size(); length++) {
+        values[s.variable].assign(name, pos, length);
+        Match(name, pos + length, segment + 1, values, bound, found);
+    }
+
+    bound[s.variable] = false;
+    values[s.variable].clear();
+}
+
+void acdMatrix::Index(void)
+{
+    sides.assign(variables.size(), sdSRC);
+    by_value.assign(variables.size(), unordered_map<string, vector<unsigned>>());
+
+    vector<unsigned> defined(variables.size(), 0);
+
+    for (unsigned side = sdSRC; side <= sdDST; side++) {
+        for (unsigned row = 0; row < rows[side].size(); row++) {
+            const vector<string> &values = rows[side][row];
+
+            for (unsigned variable = 0; variable < values.size(); variable++) {
+                if (values[variable].empty()) continue;
+
+                // Defined by the first row of the side that has it.
+                if (defined[variable] == 0)
+                    sides[variable] = (enum Side)side;
+                else if (sides[variable] != (enum Side)side)
+                    throw invalid_argument("variable");
+
+                defined[variable]++;
+                by_value[variable][values[variable]].push_back(row);
+            }
+        }
+    }
+
+    for (auto &it : variables) {
+        if (defined[it.second] != rows[sides[it.second]].size() ||
+            defined[it.second] == 0)
+            throw invalid_argument(it.first);
+    }
+}
+
+// The rows of the side agreeing with the bound variables.
+void acdMatrix::Rows(enum Side side, const vector<string> &values,
+    const vector<bool> &bound, vector<unsigned> &found) const
+{
+    const vector<unsigned> *smallest = NULL;
+
+    for (unsigned variable = 0; variable < values.size(); variable++) {
+        if (! bound[variable] || sides[variable] != side) continue;
+
+        auto it = by_value[variable].find(values[variable]);
+        if (it == by_value[variable].end()) return;
+
+        if (smallest == NULL || it->second.size() < smallest->size())
+            smallest = &it->second;
+    }
+
+    if (smallest == NULL) {
+        for (unsigned row = 0; row < rows[side].size(); row++) found.push_back(row);
+        return;
+    }
+
+    for (auto row : *smallest) {
+        bool match = true;
+
+        for (unsigned variable = 0; match && variable < values.size(); variable++) {
+            if (bound[variable] && sides[variable] == side)
+                match = (rows[side][row][variable] == values[variable]);
+        }
+
+        if (match) found.push_back(row);
+    }
+}
+
+void acdMatrix::Pair(unsigned src, unsigned dst, const acdNameTable &names,
+    function<bool(const acdEndpointKey &key)> &present,
+    vector<acdRuleIndex::Match> &added)
+{
+    vector<string> values(variables.size());
+
+    for (unsigned variable = 0; variable < values.size(); variable++) {
+        values[variable] = (sides[variable] == sdSRC) ?
+            rows[sdSRC][src][variable] : rows[sdDST][dst][variable];
+    }
+
+    string name;
+
+    // A name never interned can't be present.
+    src_client.Expand(values, name);
+    acdNameId src_client_id = names.Find(name);
+    src_port.Expand(values, name);
+    acdNameId src_port_id = names.Find(name);
+    dst_client.Expand(values, name);
+    acdNameId dst_client_id = names.Find(name);
+    dst_port.Expand(values, name);
+    acdNameId dst_port_id = names.Find(name);
+
+    if (src_client_id == acdNameTable::invalid || src_port_id == acdNameTable::invalid ||
+        dst_client_id == acdNameTable::invalid || dst_port_id == acdNameTable::invalid)
+        return;
+
+    acdPatchKey key(acdEndpointKey(src_client_id, src_port_id),
+        acdEndpointKey(dst_client_id, dst_port_id));
+
+    if (key.first == key.second || ! present(key.first) || ! present(key.second))
+        return;
+
+    if (! active[key.first].insert(key).second) return;
+    active[key.second].insert(key);
+
+    added.push_back(acdRuleIndex::Match(key, this));
+}
+
+void acdMatrix::Appear(const acdEndpointKey &key, const acdNameTable &names,
+    function<bool(const acdEndpointKey &key)> present,
+    vector<acdRuleIndex::Match> &added)
+{
+    const string &client_name = names.Name(key.first);
+    const string &port_name = names.Name(key.second);
+    const acdTemplate *client[2] = { &src_client, &dst_client };
+    const acdTemplate *port[2] = { &src_port, &dst_port };
+
+    vector<string> values(variables.size());
+    vector<bool> bound(variables.size(), false);
+
+    for (unsigned side = sdSRC; side <= sdDST; side++) {
+        client[side]->Match(client_name, values, bound, [&]() {
+            port[side]->Match(port_name, values, bound, [&]() {
+                vector<unsigned> src_rows, dst_rows;
+
+                Rows(sdSRC, values, bound, src_rows);
+                Rows(sdDST, values, bound, dst_rows);
+
+                for (auto src : src_rows) {
+                    for (auto dst : dst_rows) Pair(src, dst, names, present, added);
+                }
+            });
+        });
+    }
+}
+
+void acdMatrix::Gone(const acdEndpointKey &key, vector<acdPatchKey> &removed)
+{
+    auto it = active.find(key);
+    if (it == active.end()) return;
+
+    set<acdPatchKey> keys;
+    keys.swap(it->second);
+    active.erase(it);
+
+    for (auto &patch_key : keys) {
+        const acdEndpointKey &other =
+            (patch_key.first == key) ? patch_key.second : patch_key.first;
+
+        auto it_other = active.find(other);
+        if (it_other != active.end()) {
+            it_other->second.erase(patch_key);
+            if (it_other->second.empty()) active.erase(it_other);
+        }
+
+        removed.push_back(patch_key);
+    }
+}
+
+void acdMatrix::Retain(function<bool(const acdEndpointKey &key)> present,
+    vector<acdPatchKey> &removed)
+{
+    vector<acdEndpointKey> gone;
+
+    for (auto &it : active) {
+        if (! present(it.first)) gone.push_back(it.first);
+    }
+
+    for (auto &key : gone) Gone(key, removed);
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
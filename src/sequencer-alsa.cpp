@@ -0,0 +1,250 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <poll.h>
+
+#include <alsa/asoundlib.h>
+
+using namespace std;
+
+#include "aconnectd.h"
+
+static void acd_client_info(acdSeqClientInfo &info, snd_seq_client_info_t *cinfo)
+{
+    info.client = snd_seq_client_info_get_client(cinfo);
+    info.name = snd_seq_client_info_get_name(cinfo);
+    info.type = snd_seq_client_info_get_type(cinfo);
+    info.card = snd_seq_client_info_get_card(cinfo);
+    info.pid = snd_seq_client_info_get_pid(cinfo);
+}
+
+static void acd_port_info(acdSeqPortInfo &info, snd_seq_port_info_t *pinfo)
+{
+    info.client = snd_seq_port_info_get_client(pinfo);
+    info.port = snd_seq_port_info_get_port(pinfo);
+    info.name = snd_seq_port_info_get_name(pinfo);
+    info.capability = snd_seq_port_info_get_capability(pinfo);
+    info.type = snd_seq_port_info_get_type(pinfo);
+}
+
+acdSequencerALSA::~acdSequencerALSA()
+{
+    if (seq != NULL && owned) snd_seq_close(seq);
+}
+
+int acdSequencerALSA::Open(const char *client_name)
+{
+    int rc;
+
+    if ((rc = snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, 0)) < 0) {
+        seq = NULL;
+        return rc;
+    }
+
+    if ((rc = snd_seq_set_client_name(seq, client_name)) < 0) {
+        snd_seq_close(seq);
+        seq = NULL;
+        fprintf(stderr, "Error setting client name.\n");
+        return rc;
+    }
+
+    owned = true;
+
+    return 0;
+}
+
+void acdSequencerALSA::Attach(snd_seq_t *handle)
+{
+    if (seq != NULL && owned) snd_seq_close(seq);
+
+    seq = handle;
+    owned = false;
+}
+
+void acdSequencerALSA::Convert(const snd_seq_event_t *ev, acdSeqEvent &event)
+{
+    event.type = ev->type;
+
+    switch (ev->type) {
+    case SND_SEQ_EVENT_PORT_SUBSCRIBED:
+    case SND_SEQ_EVENT_PORT_UNSUBSCRIBED:
+        event.sender = ev->data.connect.sender;
+        event.dest = ev->data.connect.dest;
+        break;
+
+    default:
+        event.addr = ev->data.addr;
+        break;
+    }
+}
+
+int acdSequencerALSA::ClientId(void)
+{
+    return snd_seq_client_id(seq);
+}
+
+int acdSequencerALSA::QueryNextClient(acdSeqClientInfo &info)
+{
+    snd_seq_client_info_t *cinfo;
+    snd_seq_client_info_alloca(&cinfo);
+    snd_seq_client_info_set_client(cinfo, info.client);
+
+    int rc = snd_seq_query_next_client(seq, cinfo);
+    if (rc < 0) return rc;
+
+    acd_client_info(info, cinfo);
+
+    return 0;
+}
+
+int acdSequencerALSA::GetClientInfo(int client, acdSeqClientInfo &info)
+{
+    snd_seq_client_info_t *cinfo;
+    snd_seq_client_info_alloca(&cinfo);
+
+    int rc = snd_seq_get_any_client_info(seq, client, cinfo);
+    if (rc < 0) return rc;
+
+    acd_client_info(info, cinfo);
+
+    return 0;
+}
+
+int acdSequencerALSA::QueryNextPort(acdSeqPortInfo &info)
+{
+    snd_seq_port_info_t *pinfo;
+    snd_seq_port_info_alloca(&pinfo);
+    snd_seq_port_info_set_client(pinfo, info.client);
+    snd_seq_port_info_set_port(pinfo, info.port);
+
+    int rc = snd_seq_query_next_port(seq, pinfo);
+    if (rc < 0) return rc;
+
+    acd_port_info(info, pinfo);
+
+    return 0;
+}
+
+int acdSequencerALSA::GetPortInfo(int client, int port, acdSeqPortInfo &info)
+{
+    snd_seq_port_info_t *pinfo;
+    snd_seq_port_info_alloca(&pinfo);
+
+    int rc = snd_seq_get_any_port_info(seq, client, port, pinfo);
+    if (rc < 0) return rc;
+
+    acd_port_info(info, pinfo);
+
+    return 0;
+}
+
+int acdSequencerALSA::QuerySubscribers(const snd_seq_addr_t &root,
+    snd_seq_query_subs_type_t type, int index, snd_seq_addr_t &addr)
+{
+    snd_seq_query_subscribe_t *subs;
+    snd_seq_query_subscribe_alloca(&subs);
+
+    snd_seq_query_subscribe_set_root(subs, &root);
+    snd_seq_query_subscribe_set_type(subs, type);
+    snd_seq_query_subscribe_set_index(subs, index);
+
+    int rc = snd_seq_query_port_subscribers(seq, subs);
+    if (rc < 0) return rc;
+
+    addr = *snd_seq_query_subscribe_get_addr(subs);
+
+    return 0;
+}
+
+int acdSequencerALSA::Subscribe(const snd_seq_addr_t &src, const snd_seq_addr_t &dst,
+    int queue, bool exclusive, int convert_time, int convert_real)
+{
+    snd_seq_port_subscribe_t *sub;
+    snd_seq_port_subscribe_alloca(&sub);
+
+    snd_seq_port_subscribe_set_sender(sub, &src);
+    snd_seq_port_subscribe_set_dest(sub, &dst);
+    snd_seq_port_subscribe_set_queue(sub, queue);
+    snd_seq_port_subscribe_set_exclusive(sub, exclusive);
+    snd_seq_port_subscribe_set_time_update(sub, convert_time);
+    snd_seq_port_subscribe_set_time_real(sub, convert_real);
+
+    return snd_seq_subscribe_port(seq, sub);
+}
+
+int acdSequencerALSA::Unsubscribe(const snd_seq_addr_t &src, const snd_seq_addr_t &dst)
+{
+    snd_seq_port_subscribe_t *sub;
+    snd_seq_port_subscribe_alloca(&sub);
+
+    snd_seq_port_subscribe_set_sender(sub, &src);
+    snd_seq_port_subscribe_set_dest(sub, &dst);
+
+    return snd_seq_unsubscribe_port(seq, sub);
+}
+
+int acdSequencerALSA::SubscribeAnnounce(void)
+{
+    int port = snd_seq_create_simple_port(seq, "aconnectd",
+        SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_NO_EXPORT,
+        SND_SEQ_PORT_TYPE_APPLICATION
+    );
+
+    if (port < 0) {
+        fprintf(stderr, "Error creating announce port: %s\n",
+            snd_strerror(port));
+        return port;
+    }
+
+    int rc = snd_seq_connect_from(seq, port,
+        SND_SEQ_CLIENT_SYSTEM, SND_SEQ_PORT_SYSTEM_ANNOUNCE
+    );
+
+    if (rc < 0) {
+        fprintf(stderr, "Error subscribing to System:Announce: %s\n",
+            snd_strerror(rc));
+        snd_seq_delete_simple_port(seq, port);
+        return rc;
+    }
+
+    return snd_seq_nonblock(seq, 1);
+}
+
+int acdSequencerALSA::EventInput(acdSeqEvent &event)
+{
+    int rc;
+    snd_seq_event_t *ev;
+
+    do {
+        if ((rc = snd_seq_event_input(seq, &ev)) < 0) return rc;
+    }
+    while (ev == NULL);
+
+    Convert(ev, event);
+
+    return 0;
+}
+
+int acdSequencerALSA::PollDescriptors(vector<struct pollfd> &pfds)
+{
+    int count = snd_seq_poll_descriptors_count(seq, POLLIN);
+    if (count < 0) return count;
+
+    pfds.resize(count);
+
+    return snd_seq_poll_descriptors(seq, pfds.data(), pfds.size(), POLLIN);
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
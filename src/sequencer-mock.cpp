@@ -0,0 +1,408 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <alsa/asoundlib.h>
+
+using namespace std;
+
+#include "aconnectd.h"
+
+// Same limits as the kernel sequencer.
+#define ACD_MOCK_MAX_CLIENTS    192
+#define ACD_MOCK_MAX_PORTS      254
+#define ACD_MOCK_KERNEL_CLIENT  16
+#define ACD_MOCK_USER_CLIENT    128
+
+static bool acd_addr_equal(const snd_seq_addr_t &a, const snd_seq_addr_t &b)
+{
+    return (a.client == b.client && a.port == b.port);
+}
+
+static bool acd_addr_erase(vector<snd_seq_addr_t> &addrs, const snd_seq_addr_t &addr)
+{
+    for (auto it = addrs.begin(); it != addrs.end(); it++) {
+        if (! acd_addr_equal(*it, addr)) continue;
+        addrs.erase(it);
+        return true;
+    }
+
+    return false;
+}
+
+acdSequencerMock::acdSequencerMock(size_t event_limit) :
+    my_id(-1), fd_event(-1), announce(false), overrun(false),
+    event_limit(event_limit)
+{
+    fd_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    const unsigned caps_system = SND_SEQ_PORT_CAP_READ |
+        SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_READ;
+    const unsigned caps_through = SND_SEQ_PORT_CAP_READ |
+        SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_READ |
+        SND_SEQ_PORT_CAP_SUBS_WRITE;
+
+    Client &system = clients[SND_SEQ_CLIENT_SYSTEM];
+    system.info.client = SND_SEQ_CLIENT_SYSTEM;
+    system.info.name = "System";
+    system.info.type = SND_SEQ_KERNEL_CLIENT;
+    CreatePort(SND_SEQ_CLIENT_SYSTEM, "Timer", caps_system);
+    CreatePort(SND_SEQ_CLIENT_SYSTEM, "Announce", caps_system);
+
+    int through = CreateClient("Midi Through", SND_SEQ_KERNEL_CLIENT);
+    CreatePort(through, "Midi Through Port-0", caps_through);
+
+    my_id = CreateClient("aconnectd");
+}
+
+acdSequencerMock::~acdSequencerMock()
+{
+    if (fd_event != -1) close(fd_event);
+}
+
+int acdSequencerMock::CreateClient(
+    const string &name, int type, int card, int pid)
+{
+    int id = (type == SND_SEQ_KERNEL_CLIENT) ?
+        ACD_MOCK_KERNEL_CLIENT : ACD_MOCK_USER_CLIENT;
+
+    while (id < ACD_MOCK_MAX_CLIENTS && clients.find(id) != clients.end())
+        id++;
+
+    if (id >= ACD_MOCK_MAX_CLIENTS) return -ENOMEM;
+
+    Client &client = clients[id];
+    client.info.client = id;
+    client.info.name = name;
+    client.info.type = type;
+    client.info.card = card;
+    client.info.pid = pid;
+
+    Announce(SND_SEQ_EVENT_CLIENT_START, id, 0);
+
+    return id;
+}
+
+int acdSequencerMock::DeleteClient(int client)
+{
+    auto it = clients.find(client);
+    if (it == clients.end()) return -ENOENT;
+
+    for (auto &it_port : it->second.ports) {
+        Disconnect(it_port.second);
+        Announce(SND_SEQ_EVENT_PORT_EXIT, client, it_port.first);
+    }
+
+    clients.erase(it);
+
+    Announce(SND_SEQ_EVENT_CLIENT_EXIT, client, 0);
+
+    return 0;
+}
+
+int acdSequencerMock::CreatePort(int client,
+    const string &name, unsigned capability, unsigned type)
+{
+    auto it = clients.find(client);
+    if (it == clients.end()) return -ENOENT;
+
+    int id = 0;
+    auto &ports = it->second.ports;
+
+    while (id < ACD_MOCK_MAX_PORTS && ports.find(id) != ports.end()) id++;
+
+    if (id >= ACD_MOCK_MAX_PORTS) return -ENOMEM;
+
+    Port &port = ports[id];
+    port.info.client = client;
+    port.info.port = id;
+    port.info.name = name;
+    port.info.capability = capability;
+    port.info.type = type;
+
+    Announce(SND_SEQ_EVENT_PORT_START, client, id);
+
+    return id;
+}
+
+int acdSequencerMock::DeletePort(int client, int port)
+{
+    auto it = clients.find(client);
+    if (it == clients.end()) return -ENOENT;
+
+    auto it_port = it->second.ports.find(port);
+    if (it_port == it->second.ports.end()) return -ENOENT;
+
+    Disconnect(it_port->second);
+    it->second.ports.erase(it_port);
+
+    Announce(SND_SEQ_EVENT_PORT_EXIT, client, port);
+
+    return 0;
+}
+
+int acdSequencerMock::QueryNextClient(acdSeqClientInfo &info)
+{
+    auto it = clients.upper_bound(info.client);
+    if (it == clients.end()) return -ENOENT;
+
+    info = it->second.info;
+
+    return 0;
+}
+
+int acdSequencerMock::GetClientInfo(int client, acdSeqClientInfo &info)
+{
+    auto it = clients.find(client);
+    if (it == clients.end()) return -ENOENT;
+
+    info = it->second.info;
+
+    return 0;
+}
+
+int acdSequencerMock::QueryNextPort(acdSeqPortInfo &info)
+{
+    auto it = clients.find(info.client);
+    if (it == clients.end()) return -ENOENT;
+
+    auto it_port = it->second.ports.upper_bound(info.port);
+    if (it_port == it->second.ports.end()) return -ENOENT;
+
+    info = it_port->second.info;
+
+    return 0;
+}
+
+int acdSequencerMock::GetPortInfo(int client, int port, acdSeqPortInfo &info)
+{
+    auto it = clients.find(client);
+    if (it == clients.end()) return -ENOENT;
+
+    auto it_port = it->second.ports.find(port);
+    if (it_port == it->second.ports.end()) return -ENOENT;
+
+    info = it_port->second.info;
+
+    return 0;
+}
+
+int acdSequencerMock::QuerySubscribers(const snd_seq_addr_t &root,
+    snd_seq_query_subs_type_t type, int index, snd_seq_addr_t &addr)
+{
+    Port *port = FindPort(root);
+    if (port == NULL) return -ENXIO;
+
+    const vector<snd_seq_addr_t> &addrs =
+        (type == SND_SEQ_QUERY_SUBS_READ) ? port->subscribers : port->senders;
+
+    if (index < 0 || (size_t)index >= addrs.size()) return -ENOENT;
+
+    addr = addrs[index];
+
+    return 0;
+}
+
+int acdSequencerMock::Subscribe(const snd_seq_addr_t &src, const snd_seq_addr_t &dst,
+    int queue __attribute__((unused)), bool exclusive,
+    int convert_time __attribute__((unused)),
+    int convert_real __attribute__((unused)))
+{
+    const unsigned caps_src = SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ;
+    const unsigned caps_dst = SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE;
+
+    Port *port_src = FindPort(src);
+    Port *port_dst = FindPort(dst);
+
+    if (port_src == NULL || port_dst == NULL) return -EINVAL;
+
+    // Like the kernel, the SUBS_* capabilities aren't required from the
+    // client that owns the port.
+    if (src.client != my_id &&
+        (port_src->info.capability & caps_src) != caps_src) return -EPERM;
+    if (dst.client != my_id &&
+        (port_dst->info.capability & caps_dst) != caps_dst) return -EPERM;
+
+    for (auto &addr : port_src->subscribers)
+        if (acd_addr_equal(addr, dst)) return -EBUSY;
+
+    if (port_src->exclusive_read || port_dst->exclusive_write) return -EBUSY;
+
+    if (exclusive &&
+        (! port_src->subscribers.empty() || ! port_dst->senders.empty()))
+        return -EBUSY;
+
+    port_src->subscribers.push_back(dst);
+    port_dst->senders.push_back(src);
+
+    if (exclusive) {
+        port_src->exclusive_read = true;
+        port_dst->exclusive_write = true;
+    }
+
+    Announce(SND_SEQ_EVENT_PORT_SUBSCRIBED, src, dst);
+
+    return 0;
+}
+
+int acdSequencerMock::Unsubscribe(const snd_seq_addr_t &src, const snd_seq_addr_t &dst)
+{
+    Port *port_src = FindPort(src);
+    Port *port_dst = FindPort(dst);
+
+    if (port_src == NULL || port_dst == NULL) return -EINVAL;
+
+    if (! acd_addr_erase(port_src->subscribers, dst)) return -ENOENT;
+    acd_addr_erase(port_dst->senders, src);
+
+    if (port_src->subscribers.empty()) port_src->exclusive_read = false;
+    if (port_dst->senders.empty()) port_dst->exclusive_write = false;
+
+    Announce(SND_SEQ_EVENT_PORT_UNSUBSCRIBED, src, dst);
+
+    return 0;
+}
+
+int acdSequencerMock::SubscribeAnnounce(void)
+{
+    announce = true;
+
+    return 0;
+}
+
+int acdSequencerMock::EventInput(acdSeqEvent &event)
+{
+    if (overrun) {
+        overrun = false;
+        events.clear();
+        return -ENOSPC;
+    }
+
+    if (events.empty()) {
+        uint64_t value;
+        if (read(fd_event, &value, sizeof(value)) < 0 && errno != EAGAIN)
+            return -errno;
+        return -EAGAIN;
+    }
+
+    event = events.front();
+    events.pop_front();
+
+    return 0;
+}
+
+int acdSequencerMock::PollDescriptors(vector<struct pollfd> &pfds)
+{
+    if (fd_event < 0) return -EBADF;
+
+    struct pollfd pfd;
+    memset(&pfd, 0, sizeof(struct pollfd));
+    pfd.fd = fd_event;
+    pfd.events = POLLIN;
+
+    pfds.assign(1, pfd);
+
+    return 1;
+}
+
+acdSequencerMock::Port *acdSequencerMock::FindPort(const snd_seq_addr_t &addr)
+{
+    auto it = clients.find(addr.client);
+    if (it == clients.end()) return NULL;
+
+    auto it_port = it->second.ports.find(addr.port);
+    if (it_port == it->second.ports.end()) return NULL;
+
+    return &it_port->second;
+}
+
+void acdSequencerMock::Announce(int type, int client, int port)
+{
+    if (! announce) return;
+
+    if (event_limit > 0 && events.size() >= event_limit) {
+        overrun = true;
+        return;
+    }
+
+    acdSeqEvent event;
+    memset(&event, 0, sizeof(acdSeqEvent));
+
+    event.type = type;
+    event.addr.client = (unsigned char)client;
+    event.addr.port = (unsigned char)port;
+
+    events.push_back(event);
+
+    uint64_t value = 1;
+    if (write(fd_event, &value, sizeof(value)) < 0)
+        fprintf(stderr, "eventfd: %s\n", strerror(errno));
+}
+
+void acdSequencerMock::Announce(int type,
+    const snd_seq_addr_t &src, const snd_seq_addr_t &dst)
+{
+    if (! announce) return;
+
+    if (event_limit > 0 && events.size() >= event_limit) {
+        overrun = true;
+        return;
+    }
+
+    acdSeqEvent event;
+    memset(&event, 0, sizeof(acdSeqEvent));
+
+    event.type = type;
+    event.sender = src;
+    event.dest = dst;
+
+    events.push_back(event);
+
+    uint64_t value = 1;
+    if (write(fd_event, &value, sizeof(value)) < 0)
+        fprintf(stderr, "eventfd: %s\n", strerror(errno));
+}
+
+void acdSequencerMock::Disconnect(Port &port)
+{
+    snd_seq_addr_t addr;
+    addr.client = (unsigned char)port.info.client;
+    addr.port = (unsigned char)port.info.port;
+
+    for (auto &dst : port.subscribers) {
+        Port *peer = FindPort(dst);
+        if (peer == NULL) continue;
+        acd_addr_erase(peer->senders, addr);
+        if (peer->senders.empty()) peer->exclusive_write = false;
+    }
+
+    for (auto &src : port.senders) {
+        Port *peer = FindPort(src);
+        if (peer == NULL) continue;
+        acd_addr_erase(peer->subscribers, addr);
+        if (peer->subscribers.empty()) peer->exclusive_read = false;
+    }
+
+    port.subscribers.clear();
+    port.senders.clear();
+    port.exclusive_read = false;
+    port.exclusive_write = false;
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
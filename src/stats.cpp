@@ -0,0 +1,337 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <poll.h>
+
+#include <alsa/asoundlib.h>
+
+using namespace std;
+
+#include "aconnectd.h"
+
+void acdHistogram::Clear(void)
+{
+    count = sum = max = 0;
+    min = (uint64_t)-1;
+    memset(buckets, 0, sizeof(buckets));
+}
+
+unsigned acdHistogram::Bucket(uint64_t value)
+{
+    if (value < 4) return (unsigned)value;
+
+    unsigned msb = 63 - __builtin_clzll(value);
+    unsigned bucket = (msb - 1) * 4 + ((value >> (msb - 2)) & 3);
+
+    return std::min(bucket, (unsigned)ACD_HISTOGRAM_BUCKETS - 1);
+}
+
+uint64_t acdHistogram::BucketUpper(unsigned bucket)
+{
+    if (bucket < 4) return bucket;
+    if (bucket >= ACD_HISTOGRAM_BUCKETS - 1) return (uint64_t)-1;
+
+    return ((uint64_t)(5 + bucket % 4) << (bucket / 4 - 1)) - 1;
+}
+
+void acdHistogram::Record(uint64_t value)
+{
+    buckets[Bucket(value)]++;
+    count++;
+    sum += value;
+    if (value < min) min = value;
+    if (value > max) max = value;
+}
+
+uint64_t acdHistogram::Percentile(double p) const
+{
+    if (count == 0) return 0;
+
+    uint64_t rank = (uint64_t)(p / 100.0 * count + 0.5);
+    if (rank < 1) rank = 1;
+
+    uint64_t seen = 0;
+
+    for (unsigned i = 0; i < ACD_HISTOGRAM_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank) return std::max(std::min(BucketUpper(i), max), min);
+    }
+
+    return max;
+}
+
+void acdHistogram::Print(FILE *fh, const char *prefix) const
+{
+    if (count == 0) {
+        fprintf(fh, "%s: no samples\n", prefix);
+        return;
+    }
+
+    fprintf(fh, "%s: count: %lu, min: %lu us, mean: %lu us, p50: %lu us, "
+        "p90: %lu us, p99: %lu us, max: %lu us\n", prefix,
+        (unsigned long)count, (unsigned long)min,
+        (unsigned long)(sum / count),
+        (unsigned long)Percentile(50), (unsigned long)Percentile(90),
+        (unsigned long)Percentile(99), (unsigned long)max
+    );
+}
+
+void acdLatency::Appear(const acdEndpointKey &key, uint64_t now)
+{
+    // A new address for a name that is already present isn't an
+    // appearance, keep the first stamp.
+    appeared.insert(make_pair(key, now));
+}
+
+void acdLatency::Retain(const acdAddressIndex &index)
+{
+    snd_seq_addr_t addr;
+
+    for (auto it = appeared.begin(); it != appeared.end(); ) {
+        if (index.Lookup(it->first, addr))
+            it++;
+        else
+            it = appeared.erase(it);
+    }
+}
+
+void acdLatency::Record(const acdPatchKey &key, uint64_t now)
+{
+    auto it_src = appeared.find(key.first);
+    auto it_dst = appeared.find(key.second);
+
+    if (it_src == appeared.end() || it_dst == appeared.end()) return;
+
+    uint64_t ready = std::max(it_src->second, it_dst->second);
+    Entry &entry = entries[key];
+
+    if (entry.ready == ready) return;
+    entry.ready = ready;
+
+    uint64_t value = (now > ready) ? now - ready : 0;
+
+    entry.histogram.Record(value);
+    overall.Record(value);
+}
+
+void acdLatency::Prune(const map<acdPatchKey, acdPatch> &patches)
+{
+    for (auto it = entries.begin(); it != entries.end(); ) {
+        if (patches.find(it->first) == patches.end())
+            it = entries.erase(it);
+        else
+            it++;
+    }
+}
+
+static uint64_t acd_stats_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+acdStats::acdStats() : depth(0), phase(phCOUNT), wall_start(0), cpu_start(0)
+{
+    memset(&pending, 0, sizeof(pending));
+    memset(cycles, 0, sizeof(cycles));
+    memset(totals, 0, sizeof(totals));
+    memset(next, 0, sizeof(next));
+}
+
+void acdStats::Begin(enum Phase phase)
+{
+    if (depth++ > 0) return;
+
+    // Calls made outside a phase aren't accounted.
+    memset(&pending, 0, sizeof(pending));
+
+    this->phase = phase;
+    wall_start = acd_stats_ns(CLOCK_MONOTONIC);
+    cpu_start = acd_stats_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+void acdStats::End(void)
+{
+    if (depth == 0 || --depth > 0) return;
+
+    pending.wall_ns = acd_stats_ns(CLOCK_MONOTONIC) - wall_start;
+    pending.cpu_ns = acd_stats_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+
+    for (unsigned call = 0; call < caCOUNT; call++)
+        totals[phase][call] += pending.calls[call];
+
+    cycles[phase]++;
+
+    vector<Sample> &samples = window[phase];
+
+    if (samples.size() < ACD_STATS_WINDOW)
+        samples.push_back(pending);
+    else
+        samples[next[phase]] = pending;
+
+    next[phase] = (next[phase] + 1) % ACD_STATS_WINDOW;
+
+    memset(&pending, 0, sizeof(pending));
+    phase = phCOUNT;
+}
+
+acdStats::Summary acdStats::Summarize(enum Phase phase,
+    function<uint64_t(const Sample &)> value) const
+{
+    Summary summary = { 0, 0, 0, 0 };
+    const vector<Sample> &samples = window[phase];
+
+    if (samples.empty()) return summary;
+
+    vector<uint64_t> values;
+    values.reserve(samples.size());
+
+    uint64_t sum = 0;
+
+    for (auto &sample : samples) {
+        values.push_back(value(sample));
+        sum += values.back();
+    }
+
+    sort(values.begin(), values.end());
+
+    summary.min = values.front();
+    summary.avg = sum / values.size();
+    summary.max = values.back();
+    summary.p99 = values[(values.size() * 99 + 99) / 100 - 1];
+
+    return summary;
+}
+
+acdStats::Summary acdStats::Wall(enum Phase phase) const
+{
+    return Summarize(phase, [](const Sample &sample) { return sample.wall_ns; });
+}
+
+acdStats::Summary acdStats::Cpu(enum Phase phase) const
+{
+    return Summarize(phase, [](const Sample &sample) { return sample.cpu_ns; });
+}
+
+acdStats::Summary acdStats::Calls(enum Phase phase, enum Call call) const
+{
+    return Summarize(phase,
+        [call](const Sample &sample) { return (uint64_t)sample.calls[call]; }
+    );
+}
+
+const char *acdStats::PhaseName(enum Phase phase)
+{
+    static const char *names[phCOUNT] = {
+        "refresh", "events", "resolve", "plan", "remove", "add"
+    };
+
+    return (phase < phCOUNT) ? names[phase] : "none";
+}
+
+const char *acdStats::CallName(enum Call call)
+{
+    static const char *names[caCOUNT] = {
+        "query_next_client", "get_client_info",
+        "query_next_port", "get_port_info",
+        "query_port_subscribers", "subscribe", "unsubscribe"
+    };
+
+    return (call < caCOUNT) ? names[call] : "none";
+}
+
+void acdStats::Print(FILE *fh) const
+{
+    for (unsigned i = 0; i < phCOUNT; i++) {
+        enum Phase phase = (enum Phase)i;
+        if (cycles[phase] == 0) continue;
+
+        Summary wall = Wall(phase), cpu = Cpu(phase);
+
+        fprintf(fh, "Stats: %s: cycles: %lu, wall us: %lu/%lu/%lu/%lu, "
+            "cpu us: %lu/%lu/%lu/%lu", PhaseName(phase),
+            (unsigned long)cycles[phase],
+            (unsigned long)(wall.min / 1000), (unsigned long)(wall.avg / 1000),
+            (unsigned long)(wall.max / 1000), (unsigned long)(wall.p99 / 1000),
+            (unsigned long)(cpu.min / 1000), (unsigned long)(cpu.avg / 1000),
+            (unsigned long)(cpu.max / 1000), (unsigned long)(cpu.p99 / 1000)
+        );
+
+        for (unsigned j = 0; j < caCOUNT; j++) {
+            enum Call call = (enum Call)j;
+            if (totals[phase][call] == 0) continue;
+
+            Summary calls = Calls(phase, call);
+
+            fprintf(fh, ", %s: %lu/%lu/%lu/%lu", CallName(call),
+                (unsigned long)calls.min, (unsigned long)calls.avg,
+                (unsigned long)calls.max, (unsigned long)calls.p99
+            );
+        }
+
+        fputc('\n', fh);
+    }
+}
+
+int acdSequencerCounter::QueryNextClient(acdSeqClientInfo &info)
+{
+    stats.Count(acdStats::caQUERY_CLIENT);
+    return seq->QueryNextClient(info);
+}
+
+int acdSequencerCounter::GetClientInfo(int client, acdSeqClientInfo &info)
+{
+    stats.Count(acdStats::caGET_CLIENT);
+    return seq->GetClientInfo(client, info);
+}
+
+int acdSequencerCounter::QueryNextPort(acdSeqPortInfo &info)
+{
+    stats.Count(acdStats::caQUERY_PORT);
+    return seq->QueryNextPort(info);
+}
+
+int acdSequencerCounter::GetPortInfo(int client, int port, acdSeqPortInfo &info)
+{
+    stats.Count(acdStats::caGET_PORT);
+    return seq->GetPortInfo(client, port, info);
+}
+
+int acdSequencerCounter::QuerySubscribers(const snd_seq_addr_t &root,
+    snd_seq_query_subs_type_t type, int index, snd_seq_addr_t &addr)
+{
+    stats.Count(acdStats::caQUERY_SUBSCRIBERS);
+    return seq->QuerySubscribers(root, type, index, addr);
+}
+
+int acdSequencerCounter::Subscribe(const snd_seq_addr_t &src,
+    const snd_seq_addr_t &dst, int queue, bool exclusive,
+    int convert_time, int convert_real)
+{
+    stats.Count(acdStats::caSUBSCRIBE);
+    return seq->Subscribe(src, dst, queue, exclusive, convert_time, convert_real);
+}
+
+int acdSequencerCounter::Unsubscribe(const snd_seq_addr_t &src,
+    const snd_seq_addr_t &dst)
+{
+    stats.Count(acdStats::caUNSUBSCRIBE);
+    return seq->Unsubscribe(src, dst);
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "aconnectd-status.h"
+
+// Gives up on a writer that doesn't finish its update.
+#define ACD_STATUS_ATTEMPTS     1000
+
+static const char *acd_status_states[] = {
+    "pending", "active", "failed", "backoff", "disabled"
+};
+
+// Copies a consistent snapshot of the page into a malloc'd buffer.
+static struct acd_status_header *acd_status_snapshot(int fd)
+{
+    void *map = MAP_FAILED;
+    size_t length = 0;
+    struct acd_status_header *copy = NULL;
+
+    for (int attempt = 0; attempt < ACD_STATUS_ATTEMPTS; attempt++) {
+        struct stat st;
+
+        if (fstat(fd, &st) < 0) break;
+
+        if (map == MAP_FAILED || length < (size_t)st.st_size) {
+            if (map != MAP_FAILED) munmap(map, length);
+
+            length = st.st_size;
+            if (length < sizeof(struct acd_status_header)) {
+                errno = ENODATA;
+                break;
+            }
+
+            map = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+            if (map == MAP_FAILED) break;
+        }
+
+        const struct acd_status_header *header = map;
+        uint32_t seq = acd_status_read_begin(header);
+
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+
+        uint64_t size = header->size;
+
+        if (header->magic != ACD_STATUS_MAGIC) {
+            if (acd_status_read_retry(header, seq)) continue;
+            errno = ENODATA;
+            break;
+        }
+
+        // Grown since mapped.
+        if (size > length || size < sizeof(struct acd_status_header)) {
+            if (acd_status_read_retry(header, seq)) continue;
+            munmap(map, length);
+            map = MAP_FAILED;
+            continue;
+        }
+
+        free(copy);
+        copy = malloc(size);
+        if (copy == NULL) break;
+
+        memcpy(copy, header, size);
+
+        if (! acd_status_read_retry(header, seq)) {
+            munmap(map, length);
+            return copy;
+        }
+    }
+
+    if (errno == 0) errno = EAGAIN;
+
+    free(copy);
+    if (map != MAP_FAILED) munmap(map, length);
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filename = (argc > 1) ? argv[1] : "/run/aconnectd/status";
+
+    if (argc > 2 || (argc > 1 && argv[1][0] == '-')) {
+        fprintf(stderr, "usage: %s [status file]\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        return 1;
+    }
+
+    errno = 0;
+    struct acd_status_header *status = acd_status_snapshot(fd);
+    close(fd);
+
+    if (status == NULL) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        return 1;
+    }
+
+    if (status->version != ACD_STATUS_VERSION) {
+        fprintf(stderr, "%s: unsupported version %u\n", filename, status->version);
+        free(status);
+        return 1;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    printf("pid: %d, generation: %llu, reconciles: %llu, last reconcile: %llu ms ago\n",
+        status->pid, (unsigned long long)status->generation,
+        (unsigned long long)status->reconciles,
+        (unsigned long long)(now - status->reconcile_monotonic_ms));
+    printf("clients: %u, ports: %u, subscriptions: %u\n",
+        status->clients, status->ports, status->subscriptions);
+    printf("subscriptions added: %llu, removed: %llu, failed: %llu\n",
+        (unsigned long long)status->subscriptions_added,
+        (unsigned long long)status->subscriptions_removed,
+        (unsigned long long)status->subscriptions_failed);
+    printf("patches: %u, active: %u, pending: %u, backoff: %u, failed: %u, disabled: %u\n",
+        status->patch_count,
+        status->patch_states[ACD_STATUS_ACTIVE],
+        status->patch_states[ACD_STATUS_PENDING],
+        status->patch_states[ACD_STATUS_BACKOFF],
+        status->patch_states[ACD_STATUS_FAILED],
+        status->patch_states[ACD_STATUS_DISABLED]);
+
+    const struct acd_status_patch *patch = acd_status_patches(status);
+
+    for (uint32_t i = 0; i < status->patch_count; i++, patch++) {
+        printf("%s/%s -> %s/%s: %s", patch->src_client, patch->src_port,
+            patch->dst_client, patch->dst_port,
+            (patch->state <= ACD_STATUS_DISABLED) ?
+            acd_status_states[patch->state] : "unknown");
+
+        if (patch->failures > 0)
+            printf(" (failures: %u: %s)", patch->failures, strerror(patch->error));
+
+        putchar('\n');
+    }
+
+    free(status);
+
+    return 0;
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
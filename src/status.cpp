@@ -0,0 +1,327 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <alsa/asoundlib.h>
+
+using namespace std;
+
+#include "aconnectd.h"
+#include "aconnectd-status.h"
+
+// Longest a published port or subscription count may be out of date.
+#define ACD_STATUS_TOTALS_MS    1000
+
+static void acd_status_name(char *dst, const string &src)
+{
+    size_t length = min(src.size(), (size_t)ACD_STATUS_NAME_MAX - 1);
+
+    memcpy(dst, src.data(), length);
+    memset(dst + length, 0, ACD_STATUS_NAME_MAX - length);
+}
+
+acdStatusPage::~acdStatusPage()
+{
+    Close();
+}
+
+bool acdStatusPage::Open(const string &filename)
+{
+    Close();
+
+    // An existing file is reused, not truncated, so that readers still
+    // mapping it never fault.
+    fd = open(filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Status page: %s: %s\n", filename.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (! Reserve(0)) {
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+void acdStatusPage::Close(void)
+{
+    if (page != NULL) munmap(page, length);
+    if (fd != -1) close(fd);
+
+    page = NULL;
+    length = 0;
+    fd = -1;
+}
+
+bool acdStatusPage::Reserve(size_t patches)
+{
+    size_t needed = sizeof(struct acd_status_header) +
+        patches * sizeof(struct acd_status_patch);
+
+    if (page != NULL && needed <= length) return true;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "Status page: fstat: %s\n", strerror(errno));
+        return false;
+    }
+
+    // Room for 64 patches at first, then doubled; never shrunk.
+    size_t size = sizeof(struct acd_status_header) +
+        64 * sizeof(struct acd_status_patch);
+
+    while (size < needed) size *= 2;
+    size = max(size, (size_t)st.st_size);
+
+    if ((size_t)st.st_size < size && ftruncate(fd, size) < 0) {
+        fprintf(stderr, "Status page: ftruncate: %s\n", strerror(errno));
+        return false;
+    }
+
+    void *map = (page == NULL) ?
+        mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) :
+        mremap(page, length, size, MREMAP_MAYMOVE);
+
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Status page: mmap: %s\n", strerror(errno));
+        return false;
+    }
+
+    bool fresh = (page == NULL);
+
+    page = (struct acd_status_header *)map;
+    length = size;
+
+    if (fresh) {
+        // Left odd by a writer that died mid-update, or a new file.
+        uint32_t seq = __atomic_load_n(&page->seq, __ATOMIC_RELAXED);
+
+        __atomic_store_n(&page->seq, (seq | 1) + 1, __ATOMIC_RELEASE);
+        generation = page->generation;
+        synced = false;
+    }
+
+    return true;
+}
+
+void acdStatusPage::Header(const acdContext &ctx, bool totals)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    uint64_t now = acd_time_ms();
+
+    page->magic = ACD_STATUS_MAGIC;
+    page->version = ACD_STATUS_VERSION;
+    page->pid = getpid();
+    page->size = sizeof(struct acd_status_header) +
+        slot_keys.size() * sizeof(struct acd_status_patch);
+    page->generation = ++generation;
+    page->reconcile_monotonic_ms = now;
+    page->reconcile_realtime_ms =
+        (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    page->reconciles = ctx.metrics.reconciles.load(memory_order_relaxed);
+    page->subscriptions_added = ctx.metrics.subscribed.load(memory_order_relaxed);
+    page->subscriptions_removed = ctx.metrics.unsubscribed.load(memory_order_relaxed);
+    page->subscriptions_failed = ctx.metrics.failed.load(memory_order_relaxed);
+
+    if (totals || now - totals_ms >= ACD_STATUS_TOTALS_MS) {
+        ports = 0;
+        subscriptions = 0;
+
+        for (auto &it_client : ctx.clients) {
+            ports += it_client.second.ports.size();
+            for (auto &it_port : it_client.second.ports)
+                subscriptions += it_port.second.subscribers.size();
+        }
+
+        totals_ms = now;
+    }
+
+    page->clients = ctx.clients.size();
+    page->ports = ports;
+    page->subscriptions = subscriptions;
+    page->patch_count = slot_keys.size();
+}
+
+void acdStatusPage::Record(const acdContext &ctx, const acdPatchKey &key,
+    const acdPatch &patch, bool disabled, struct acd_status_patch *record)
+{
+    acd_status_name(record->src_client, patch.src_client);
+    acd_status_name(record->src_port, patch.src_port);
+    acd_status_name(record->dst_client, patch.dst_client);
+    acd_status_name(record->dst_port, patch.dst_port);
+
+    record->state = ACD_STATUS_PENDING;
+    record->failures = 0;
+    record->error = 0;
+    record->reserved = 0;
+
+    if (disabled) {
+        record->state = ACD_STATUS_DISABLED;
+        return;
+    }
+
+    auto it_backoff = ctx.backoff.Entries().find(key);
+    snd_seq_addr_t src, dst;
+
+    if (ctx.address_index.Lookup(key.first, src) &&
+        ctx.address_index.Lookup(key.second, dst)) {
+        const acdPort *src_port = ctx.TopologyFind(src);
+
+        if (src_port != NULL &&
+            src_port->subscribers.count(acdSubAddr(dst.client, dst.port)) > 0)
+            record->state = ACD_STATUS_ACTIVE;
+        else if (it_backoff != ctx.backoff.Entries().end()) {
+            record->state =
+                (it_backoff->second.retry_at == acdBackoff::never) ?
+                ACD_STATUS_FAILED : ACD_STATUS_BACKOFF;
+        }
+    }
+
+    if (it_backoff != ctx.backoff.Entries().end()) {
+        record->failures = it_backoff->second.failures;
+        record->error = it_backoff->second.error;
+    }
+}
+
+void acdStatusPage::Publish(const acdContext &ctx)
+{
+    if (page == NULL) return;
+
+    size_t patches = ctx.config.patches.size() + ctx.config.disabled.size();
+
+    if (! Reserve(patches)) return;
+
+    uint32_t seq = __atomic_load_n(&page->seq, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slots.clear();
+    slot_keys.clear();
+    memset(page->patch_states, 0, sizeof(page->patch_states));
+
+    struct acd_status_patch *record = (struct acd_status_patch *)(page + 1);
+
+    for (auto &it : ctx.config.patches) {
+        Record(ctx, it.first, it.second, false, record);
+        page->patch_states[record->state]++;
+
+        slots[it.first] = slot_keys.size();
+        slot_keys.push_back(it.first);
+        record++;
+    }
+
+    for (auto &it : ctx.config.disabled) {
+        Record(ctx, it.first, it.second, true, record);
+        page->patch_states[record->state]++;
+
+        slots[it.first] = slot_keys.size();
+        slot_keys.push_back(it.first);
+        record++;
+    }
+
+    Header(ctx, true);
+    synced = true;
+
+    __atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void acdStatusPage::Publish(const acdContext &ctx, const set<acdPatchKey> &keys)
+{
+    if (page == NULL) return;
+
+    if (! synced) {
+        Publish(ctx);
+        return;
+    }
+
+    // Grown before the update, mremap() may move the page.
+    if (! Reserve(slot_keys.size() + keys.size())) return;
+
+    uint32_t seq = __atomic_load_n(&page->seq, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    struct acd_status_patch *records = (struct acd_status_patch *)(page + 1);
+
+    for (auto &key : keys) {
+        const acdPatch *patch = NULL;
+        bool disabled = false;
+
+        auto it_patch = ctx.config.patches.find(key);
+
+        if (it_patch != ctx.config.patches.end())
+            patch = &it_patch->second;
+        else {
+            it_patch = ctx.config.disabled.find(key);
+            if (it_patch != ctx.config.disabled.end()) {
+                patch = &it_patch->second;
+                disabled = true;
+            }
+        }
+
+        auto it = slots.find(key);
+
+        if (it == slots.end()) {
+            if (patch == NULL) continue;
+
+            it = slots.insert(make_pair(key, (uint32_t)slot_keys.size())).first;
+            slot_keys.push_back(key);
+        }
+        else {
+            page->patch_states[records[it->second].state]--;
+
+            // Dropped: the last record takes its slot.
+            if (patch == NULL) {
+                uint32_t last = slot_keys.size() - 1;
+
+                if (it->second != last) {
+                    records[it->second] = records[last];
+                    slot_keys[it->second] = slot_keys[last];
+                    slots[slot_keys[last]] = it->second;
+                }
+
+                slot_keys.pop_back();
+                slots.erase(it);
+                continue;
+            }
+        }
+
+        struct acd_status_patch *record = records + it->second;
+
+        Record(ctx, key, *patch, disabled, record);
+        page->patch_states[record->state]++;
+    }
+
+    Header(ctx, false);
+
+    __atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4